@@ -0,0 +1 @@
+@for %%f in (test.lox bla.lox profile\*.lox) do "../bin/Release-x64/clox.exe" %%f --op-profile -np -ns
\ No newline at end of file
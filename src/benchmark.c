@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "benchmark.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+// fills a table of 65536 slots right up to its maximum load
+#define BENCH_KEY_COUNT 57344
+// bytes hashed per throughput measurement
+#define BENCH_HASH_BYTES (64 * 1024 * 1024)
+#define BENCH_PROBE_BUCKETS 5
+
+typedef uint32_t(*hash_func_t)(const char* key, int length);
+
+typedef struct {
+    const char* name;
+    hash_func_t func;
+} bench_hash_t;
+
+typedef struct {
+    char* chars;
+    int* offsets;
+    int* lengths;
+    size_t total_length;
+} key_set_t;
+
+static void make_keys(key_set_t* keys, const char* prefix, int prefix_length)
+{
+    keys->chars = malloc((size_t)BENCH_KEY_COUNT * (prefix_length + 16));
+    keys->offsets = malloc(sizeof(int) * BENCH_KEY_COUNT);
+    keys->lengths = malloc(sizeof(int) * BENCH_KEY_COUNT);
+    keys->total_length = 0;
+
+    int offset = 0;
+    for (int i = 0; i < BENCH_KEY_COUNT; i++)
+    {
+        int length = sprintf(keys->chars + offset, "%.*s%d", prefix_length, prefix, i);
+        keys->offsets[i] = offset;
+        keys->lengths[i] = length;
+        keys->total_length += length;
+        offset += length;
+    }
+}
+
+static void free_keys(key_set_t* keys)
+{
+    free(keys->chars);
+    free(keys->offsets);
+    free(keys->lengths);
+}
+
+static double hash_throughput(key_set_t* keys, hash_func_t hash)
+{
+    int rounds = (int)(BENCH_HASH_BYTES / keys->total_length) + 1;
+    volatile uint32_t sink = 0;
+
+    clock_t start = clock();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < BENCH_KEY_COUNT; i++)
+            sink ^= hash(keys->chars + keys->offsets[i], keys->lengths[i]);
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    (void)sink;
+    return seconds > 0 ? (double)keys->total_length * rounds / seconds / (1024 * 1024) : 0;
+}
+
+static void probe_lengths(key_set_t* keys, hash_func_t hash)
+{
+    // the keys only need a hash and an identity, they never become heap objects
+    obj_string_t* strings = calloc(BENCH_KEY_COUNT, sizeof(obj_string_t));
+    table_t table;
+    init_table(&table);
+
+    for (int i = 0; i < BENCH_KEY_COUNT; i++)
+    {
+        strings[i].chars = keys->chars + keys->offsets[i];
+        strings[i].length = keys->lengths[i];
+        strings[i].hash = hash(strings[i].chars, strings[i].length);
+        table_set(&table, strings + i, NIL_VAL);
+    }
+
+    int buckets[BENCH_PROBE_BUCKETS] = { 0 };
+    int max_groups = 0;
+    long compares = 0;
+    for (int i = 0; i < BENCH_KEY_COUNT; i++)
+    {
+        int key_compares;
+        int groups = table_probe_length(&table, strings + i, &key_compares);
+        buckets[groups < BENCH_PROBE_BUCKETS ? groups - 1 : BENCH_PROBE_BUCKETS - 1]++;
+        if (groups > max_groups)
+            max_groups = groups;
+        compares += key_compares;
+    }
+
+    for (int i = 0; i < BENCH_PROBE_BUCKETS; i++)
+        printf(" %6.2f%%", 100.0 * buckets[i] / BENCH_KEY_COUNT);
+    printf(" %4d %9.3f\n", max_groups, (double)compares / BENCH_KEY_COUNT);
+
+    free_table(&table);
+    free(strings);
+}
+
+void benchmark_hash(void)
+{
+    bench_hash_t hashes[] = {
+        { "fnv1a", hash_fnv1a },
+        { "words", hash_words },
+    };
+
+    char long_prefix[200];
+    memset(long_prefix, 'x', sizeof(long_prefix));
+
+    struct {
+        const char* name;
+        const char* prefix;
+        int prefix_length;
+    } sets[] = {
+        { "numbers", "", 0 },
+        { "names", "name_", 5 },
+        { "long", long_prefix, (int)sizeof(long_prefix) },
+    };
+
+    printf("%d keys per set, table load %.3f\n", BENCH_KEY_COUNT, BENCH_KEY_COUNT / 65536.0);
+    printf("%-8s %-6s %9s   groups probed: %7s %7s %7s %7s %7s  max compares\n",
+        "keys", "hash", "MB/s", "1", "2", "3", "4", "5+");
+
+    for (int s = 0; s < (int)(sizeof(sets) / sizeof(sets[0])); s++)
+    {
+        key_set_t keys;
+        make_keys(&keys, sets[s].prefix, sets[s].prefix_length);
+
+        for (int h = 0; h < (int)(sizeof(hashes) / sizeof(hashes[0])); h++)
+        {
+            printf("%-8s %-6s %9.1f                 ", sets[s].name, hashes[h].name, hash_throughput(&keys, hashes[h].func));
+            probe_lengths(&keys, hashes[h].func);
+        }
+
+        free_keys(&keys);
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef clox_benchmark_h
+#define clox_benchmark_h
+
+#include "common.h"
+
+// compares the string hashes: throughput and how long lookups probe in a full table
+void benchmark_hash(void);
+
+#endif
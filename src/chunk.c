@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void init_chunk(chunk_t* chunk)
 {
@@ -11,6 +13,8 @@ void init_chunk(chunk_t* chunk)
     chunk->lines = NULL;
 
     init_value_array(&chunk->constants);
+    chunk->constant_index = NULL;
+    chunk->constant_index_capacity = 0;
 }
 
 void free_chunk(chunk_t* chunk)
@@ -18,6 +22,7 @@ void free_chunk(chunk_t* chunk)
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     free_value_array(&chunk->constants);
+    free_constant_index(chunk);
     init_chunk(chunk);
 }
 
@@ -54,16 +59,179 @@ void write_constant(chunk_t* chunk, value_t value, int line)
     }
 }
 
+// has to agree with values_equal: strings by contents, 0 and -0 alike
+static uint32_t hash_constant(value_t value)
+{
+    if (IS_STRING(value))
+    {
+        obj_string_t* str = AS_STRING(value);
+        return str->is_interned ? str->hash : hash_string(str->chars, str->length);
+    }
+
+    uint64_t bits;
+    if (IS_NUMBER(value))
+    {
+        double num = AS_NUMBER(value);
+        if (num == 0)
+            num = 0;
+        memcpy(&bits, &num, sizeof(bits));
+    }
+    else if (IS_OBJ(value))
+    {
+        bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    }
+    else
+    {
+        bits = IS_NIL(value) ? 1 : 2 + AS_BOOL(value);
+    }
+
+    bits *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(bits >> 32);
+}
+
+// returns the index slot holding an equal constant, or the free slot where it belongs
+static int find_constant(chunk_t* chunk, value_t value, uint32_t hash)
+{
+    int mask = chunk->constant_index_capacity - 1;
+    for (int slot = hash & mask; ; slot = (slot + 1) & mask)
+    {
+        int constant = chunk->constant_index[slot];
+        if (constant < 0 || values_equal(chunk->constants.values[constant], value))
+            return slot;
+    }
+}
+
+static void grow_constant_index(chunk_t* chunk)
+{
+    int old_capacity = chunk->constant_index_capacity;
+    FREE_ARRAY(int, chunk->constant_index, old_capacity);
+
+    // kept at most half full
+    chunk->constant_index_capacity = GROW_CAPACITY(old_capacity) * 2;
+    chunk->constant_index = ALLOCATE(int, chunk->constant_index_capacity);
+    memset(chunk->constant_index, -1, sizeof(int) * chunk->constant_index_capacity);
+
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        value_t constant = chunk->constants.values[i];
+        chunk->constant_index[find_constant(chunk, constant, hash_constant(constant))] = i;
+    }
+}
+
 int add_constant(chunk_t* chunk, value_t value)
 {
-    // check if value already in constants and return reference to that
-    for (int i = 0; i < chunk->constants.capacity; ++i)
+    uint32_t hash = hash_constant(value);
+    if (chunk->constant_index_capacity > 0)
     {
-        if (values_equal(chunk->constants.values[i], value))
-        {
-            return i;
-        }
+        int slot = find_constant(chunk, value, hash);
+        if (chunk->constant_index[slot] >= 0)
+            return chunk->constant_index[slot];
     }
+
+    // growing the arrays may collect, keep the value reachable until it is stored
+    push(value);
     write_value_array(&chunk->constants, value);
+    if (chunk->constants.count * 2 > chunk->constant_index_capacity)
+        grow_constant_index(chunk);
+    else
+        chunk->constant_index[find_constant(chunk, value, hash)] = chunk->constants.count - 1;
+    pop();
     return chunk->constants.count - 1;
 }
+
+void free_constant_index(chunk_t* chunk)
+{
+    FREE_ARRAY(int, chunk->constant_index, chunk->constant_index_capacity);
+    chunk->constant_index = NULL;
+    chunk->constant_index_capacity = 0;
+}
+
+int instruction_length(chunk_t* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_POPN:
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+    case OP_POP_LOOP:
+    case OP_POP_JUMP:
+    case OP_GET_GLOBAL_GET_LOCAL:
+        return 4;
+    case OP_CLOSURE: {
+        obj_function_t* func = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + 2 * func->upvalueCount;
+    }
+    default:
+        return 1;
+    }
+}
+
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint8_t fused;
+} superinstruction_t;
+
+// the most frequent pairs of adjacent instructions, as a share of all executed pairs averaged
+// over programs/test.lox, programs/bla.lox and programs/profile (programs/profile.bat runs them
+// with --op-profile -np -ns). pairs that only meet across a jump, like a loop and its first
+// instruction, can not be fused and are left out. so are pairs like constant+add (5.5%) and
+// less+jump_if_false (3.7%), whose instructions a pair above mostly claims first.
+static const superinstruction_t SUPERINSTRUCTIONS[] = {
+    { OP_GET_LOCAL, OP_CONSTANT, OP_GET_LOCAL_CONSTANT },       // 10.0%
+    { OP_JUMP_IF_FALSE, OP_POP, OP_JUMP_IF_FALSE_POP },         //  5.4%
+    // the peephole pass turns some of the pair above into this one
+    { OP_JUMP_IF_TRUE, OP_POP, OP_JUMP_IF_TRUE_POP },
+    { OP_POP, OP_LOOP, OP_POP_LOOP },                           //  4.9%
+    { OP_POP, OP_JUMP, OP_POP_JUMP },                           //  3.2%
+    { OP_GET_GLOBAL, OP_GET_LOCAL, OP_GET_GLOBAL_GET_LOCAL },   //  2.8%
+    { OP_SET_GLOBAL, OP_POP, OP_SET_GLOBAL_POP },               //  2.4%
+    { OP_SET_LOCAL, OP_POP, OP_SET_LOCAL_POP },                 //  2.3%
+};
+
+// only the first opcode changes, the second instruction stays where it was. the code keeps its
+// length and a jump to the second instruction still finds it intact.
+void fuse_superinstructions(chunk_t* chunk)
+{
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        int length = instruction_length(chunk, offset);
+        int next = offset + length;
+
+        for (int i = 0; next < chunk->count && i < (int)(sizeof(SUPERINSTRUCTIONS) / sizeof(SUPERINSTRUCTIONS[0])); i++)
+        {
+            const superinstruction_t* super = SUPERINSTRUCTIONS + i;
+            if (chunk->code[offset] == super->first && chunk->code[next] == super->second)
+            {
+                length += instruction_length(chunk, next);
+                chunk->code[offset] = super->fused;
+                break;
+            }
+        }
+
+        offset += length;
+    }
+}
@@ -34,19 +34,41 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    // only emitted by the peephole pass, for a negated condition
+    OP_JUMP_IF_TRUE,
     OP_LOOP,
     OP_CALL,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
-    OP_RETURN
+    OP_RETURN,
+    // specialized forms the interpreter rewrites generic instructions into after seeing
+    // number operands, the compiler never emits them
+    OP_EQUAL_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_ADD_NUMBER,
+    // superinstructions, each replaces the first opcode of a frequent pair and runs both
+    OP_GET_LOCAL_CONSTANT,
+    OP_JUMP_IF_FALSE_POP,
+    OP_JUMP_IF_TRUE_POP,
+    OP_POP_LOOP,
+    OP_POP_JUMP,
+    OP_GET_GLOBAL_GET_LOCAL,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_POP
 } opcode_t;
 
+#define OPCODE_COUNT (OP_SET_GLOBAL_POP + 1)
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     value_array_t constants;
+    // hash index over constants to find duplicates while compiling, free slots hold -1
+    int* constant_index;
+    int constant_index_capacity;
 } chunk_t;
 
 void init_chunk(chunk_t* chunk);
@@ -54,6 +76,13 @@ void free_chunk(chunk_t* chunk);
 void write_chunk(chunk_t* chunk, uint8_t byte, int line);
 void write_constant(chunk_t* chunk, value_t value, int line);
 
+// returns the index of an equal constant if the chunk has one already
 int add_constant(chunk_t* chunk, value_t value);
+// drops the dedup index once no more constants are added
+void free_constant_index(chunk_t* chunk);
+// size in bytes of the instruction at offset, operands included
+int instruction_length(chunk_t* chunk, int offset);
+// rewrites frequent instruction pairs into superinstructions
+void fuse_superinstructions(chunk_t* chunk);
 
 #endif
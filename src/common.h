@@ -4,9 +4,43 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// pack values into a single 64 bit word instead of a tagged union
+#define NAN_BOXING
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
+// allocate objects into a bump pointer nursery and collect it separately from the old objects
+//#define GC_GENERATIONAL
+// interleave marking and sweeping with execution in small time boxed steps
+//#define GC_INCREMENTAL
+
+#if defined(GC_GENERATIONAL) && defined(GC_INCREMENTAL)
+#error "GC_GENERATIONAL and GC_INCREMENTAL can not be combined"
+#endif
+
+// hash strings a byte at a time with FNV-1a instead of a word at a time
+//#define HASH_FNV1A
+
+// dispatch bytecode through a table of label addresses where the compiler has them (gcc, clang)
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// bypass the size-class pool and hand every allocation straight to malloc/realloc/free
+//#define USE_SYSTEM_ALLOCATOR
+
+// collect on every allocation that grows the heap
+//#define DEBUG_STRESS_GC
+//#define DEBUG_LOG_GC
+
+// for globals touched on every instruction, so their layout does not depend on their neighbours
+#ifdef _MSC_VER
+#define CACHE_ALIGNED __declspec(align(64))
+#else
+#define CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
@@ -4,7 +4,10 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -68,6 +71,9 @@ typedef struct compiler__ {
 
 parser_t parser;
 compiler_t* current = NULL;
+// options of the running compile(), they hold for every function in the source
+bool print_code;
+bool optimize_code;
 chunk_t* compiling_chunk;
 
 static chunk_t* current_chunk(void)
@@ -233,7 +239,7 @@ static void init_compiler(compiler_t* compiler, function_type_t type)
 
     if (type != TYPE_SCRIPT)
     {
-        current->function->name = copy_string(parser.previous.start, parser.previous.length);
+        current->function->name = borrow_string(parser.previous.start, parser.previous.length);
     }
 
     local_t* local = &current->locals[current->local_count++];
@@ -243,16 +249,31 @@ static void init_compiler(compiler_t* compiler, function_type_t type)
     local->name.length = 0;
 }
 
-static obj_function_t* end_compiler(bool printCode)
+static obj_function_t* end_compiler(void)
 {
     emit_return();
 
     obj_function_t* func = current->function;
+    // the chunk was written without barriers while the function was a compiler root
+    write_barrier((obj_t*)func);
+    free_constant_index(current_chunk());
+    // code with errors is never run, and may not even decode
+    if (!parser.had_error)
+    {
+        if (optimize_code)
+            optimize_chunk(current_chunk());
+        if (vm.specialize)
+            fuse_superinstructions(current_chunk());
+    }
 
 //#ifdef DEBUG_PRINT_CODE
-    if (printCode && !parser.had_error)
+    if (print_code && !parser.had_error)
     {
-        disassemble_chunk(current_chunk(), func->name != NULL ? func->name->chars : "<script>");
+        // names borrowed from the source are not null terminated
+        char name[64] = "<script>";
+        if (func->name != NULL)
+            snprintf(name, sizeof(name), "%.*s", func->name->length, func->name->chars);
+        disassemble_chunk(current_chunk(), name);
     }
 //#endif
 
@@ -289,7 +310,7 @@ static void expression(void);
 static void statement(void);
 static void declaration(void);
 static void fun_declaration(void);
-static int identifier_constant(token_t* token);
+static int global_variable(token_t* token);
 static int resolve_local(compiler_t* compiler, token_t* name);
 
 static parse_rule_t* get_rule(token_type_t type);
@@ -373,7 +394,7 @@ static void number(bool canAssign)
 
 static void string(bool canAssign)
 {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    emit_constant(OBJ_VAL(borrow_string(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static void named_variable(token_t name, bool canAssign)
@@ -392,7 +413,7 @@ static void named_variable(token_t name, bool canAssign)
     }
     else
     {
-        arg = identifier_constant(&name);
+        arg = global_variable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
@@ -535,9 +556,18 @@ static parse_rule_t* get_rule(token_type_t type)
     return &rules[type];
 }
 
-static int identifier_constant(token_t* token)
+// globals live in slots of the vm, the name only matters while compiling
+static int global_variable(token_t* token)
 {
-    return make_constant(OBJ_VAL(copy_string(token->start, token->length)));
+    int slot = global_slot(borrow_string(token->start, token->length));
+
+    if (slot > 0xFFFFFF)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
 static bool identifier_equals(token_t* a, token_t* b)
@@ -646,7 +676,7 @@ static int parse_variable(const char* errorMessage)
     if (current->scope_depth > 0)
         return 0;
 
-    return identifier_constant(&parser.previous);
+    return global_variable(&parser.previous);
 }
 
 static void mark_initialized(void)
@@ -900,9 +930,15 @@ static void function(function_type_t type)
     consume(TOKEN_LEFT_BRACE, "Expect '{' after function body.");
     block();
 
-    // TODO: somehow pass 'printCode' param to here!
-    obj_function_t* func = end_compiler(false);
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(func)));
+    obj_function_t* func = end_compiler();
+    // the closure operand is a single byte
+    int constant = make_constant(OBJ_VAL(func));
+    if (constant > UINT8_MAX)
+    {
+        error("Too many constants in one chunk.");
+        constant = 0;
+    }
+    emit_bytes(OP_CLOSURE, (uint8_t)constant);
 
     for (int i = 0; i < func->upvalueCount; i++)
     {
@@ -952,8 +988,14 @@ static void statement(void)
     }
 }
 
-obj_function_t* compile(const char* source, bool printCode)
+obj_function_t* compile(const char* source, bool printCode, bool optimize)
 {
+    print_code = printCode;
+    optimize_code = optimize;
+
+    alloc_site_t previous_site = vm.alloc_site;
+    vm.alloc_site = ALLOC_SITE_COMPILER;
+
     init_scanner(source);
     compiler_t compiler;
     init_compiler(&compiler, TYPE_SCRIPT);
@@ -967,6 +1009,17 @@ obj_function_t* compile(const char* source, bool printCode)
         declaration();
     }
 
-    obj_function_t* func = end_compiler(printCode);
+    obj_function_t* func = end_compiler();
+    vm.alloc_site = previous_site;
     return parser.had_error ? NULL : func;
 }
+
+void mark_compiler_roots(void)
+{
+    for (compiler_t* compiler = current; compiler != NULL; compiler = compiler->enclosing)
+    {
+        mark_object((obj_t*)compiler->function);
+        // functions being compiled get written without barriers, so always rescan them
+        write_barrier((obj_t*)compiler->function);
+    }
+}
@@ -4,6 +4,7 @@
 #include "object.h"
 #include "vm.h"
 
-obj_function_t* compile(const char* source, bool printCode);
+obj_function_t* compile(const char* source, bool printCode, bool optimize);
+void mark_compiler_roots(void);
 
 #endif
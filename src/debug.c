@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 void disassemble_chunk(chunk_t* chunk, const char* name)
 {
@@ -34,6 +37,27 @@ static int constant_long_instruction(const char* name, chunk_t* chunk, int offse
     return offset + 4;
 }
 
+static void global_instruction(const char* name, int slot)
+{
+    obj_string_t* global = global_name(slot);
+    printf("%-16s\t%4d '%.*s'\n", name, slot, global->length, global->chars);
+}
+
+static int global_byte_instruction(const char* name, chunk_t* chunk, int offset)
+{
+    global_instruction(name, chunk->code[offset + 1]);
+    return offset + 2;
+}
+
+static int global_long_instruction(const char* name, chunk_t* chunk, int offset)
+{
+    int slot = (chunk->code[offset + 1] << 16) |
+        (chunk->code[offset + 2] << 8) |
+        (chunk->code[offset + 3]);
+    global_instruction(name, slot);
+    return offset + 4;
+}
+
 static int simple_instruction(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -55,6 +79,35 @@ static int jump_instruction(const char* name, int sign, chunk_t* chunk, int offs
     return offset + 3;
 }
 
+// superinstructions print as one line that covers the opcode and operands of both halves
+
+static int local_constant_instruction(const char* name, chunk_t* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 3];
+    printf("%-16s\t%4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int global_local_instruction(const char* name, chunk_t* chunk, int offset)
+{
+    obj_string_t* global = global_name(chunk->code[offset + 1]);
+    uint8_t slot = chunk->code[offset + 3];
+    printf("%-16s\t%4d '%.*s' %4d\n", name, chunk->code[offset + 1], global->length, global->chars, slot);
+    return offset + 4;
+}
+
+// the jump operand follows the popped byte, the offset is taken from the end of the pair
+static int pop_jump_instruction(const char* name, int sign, chunk_t* chunk, int offset)
+{
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
 int disassemble_instruction(chunk_t* chunk, int offset)
 {
     printf("%04d ", offset);
@@ -88,17 +141,17 @@ int disassemble_instruction(chunk_t* chunk, int offset)
     case OP_SET_LOCAL:
         return byte_instruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        return global_byte_instruction("OP_GET_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL_LONG:
-        return constant_long_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        return global_long_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return global_byte_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL_LONG:
-        return constant_long_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        return global_long_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OP_SET_GLOBAL:
-        return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        return global_byte_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL_LONG:
-        return constant_long_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        return global_long_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
     case OP_GET_UPVALUE:
         return byte_instruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
@@ -129,6 +182,8 @@ int disassemble_instruction(chunk_t* chunk, int offset)
         return jump_instruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
         return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_TRUE:
+        return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
     case OP_LOOP:
         return jump_instruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
@@ -154,8 +209,166 @@ int disassemble_instruction(chunk_t* chunk, int offset)
         return simple_instruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
         return simple_instruction("OP_RETURN", offset);
+    case OP_EQUAL_NUMBER:
+        return simple_instruction("OP_EQUAL_NUMBER", offset);
+    case OP_GREATER_NUMBER:
+        return simple_instruction("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:
+        return simple_instruction("OP_LESS_NUMBER", offset);
+    case OP_ADD_NUMBER:
+        return simple_instruction("OP_ADD_NUMBER", offset);
+    case OP_GET_LOCAL_CONSTANT:
+        return local_constant_instruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+    case OP_JUMP_IF_FALSE_POP:
+        return jump_instruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset) + 1;
+    case OP_JUMP_IF_TRUE_POP:
+        return jump_instruction("OP_JUMP_IF_TRUE_POP", 1, chunk, offset) + 1;
+    case OP_POP_LOOP:
+        return pop_jump_instruction("OP_POP_LOOP", -1, chunk, offset);
+    case OP_POP_JUMP:
+        return pop_jump_instruction("OP_POP_JUMP", 1, chunk, offset);
+    case OP_GET_GLOBAL_GET_LOCAL:
+        return global_local_instruction("OP_GET_GLOBAL_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byte_instruction("OP_SET_LOCAL_POP", chunk, offset) + 1;
+    case OP_SET_GLOBAL_POP:
+        return global_byte_instruction("OP_SET_GLOBAL_POP", chunk, offset) + 1;
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
     }
 }
+
+static const char* OPCODE_NAMES[OPCODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_POPN] = "OP_POPN",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_EQUAL_NUMBER] = "OP_EQUAL_NUMBER",
+    [OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+    [OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+    [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+    [OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+    [OP_JUMP_IF_FALSE_POP] = "OP_JUMP_IF_FALSE_POP",
+    [OP_JUMP_IF_TRUE_POP] = "OP_JUMP_IF_TRUE_POP",
+    [OP_POP_LOOP] = "OP_POP_LOOP",
+    [OP_POP_JUMP] = "OP_POP_JUMP",
+    [OP_GET_GLOBAL_GET_LOCAL] = "OP_GET_GLOBAL_GET_LOCAL",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP"
+};
+
+const char* opcode_name(uint8_t instruction)
+{
+    return instruction < OPCODE_COUNT ? OPCODE_NAMES[instruction] : "?";
+}
+
+#define PROFILE_TOP 20
+
+static uint64_t profile_total;
+static uint64_t profile_pairs[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t profile_triples[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+// the last two instructions, OPCODE_COUNT while there are none yet
+static uint8_t profile_previous[2] = { OPCODE_COUNT, OPCODE_COUNT };
+
+void profile_instruction(uint8_t instruction)
+{
+    uint8_t first = profile_previous[0];
+    uint8_t second = profile_previous[1];
+
+    profile_total++;
+    if (second < OPCODE_COUNT)
+        profile_pairs[second][instruction]++;
+    if (first < OPCODE_COUNT)
+        profile_triples[first][second][instruction]++;
+
+    profile_previous[0] = second;
+    profile_previous[1] = instruction;
+}
+
+typedef struct {
+    uint64_t count;
+    uint8_t ops[3];
+} profile_entry_t;
+
+static int compare_entries(const void* a, const void* b)
+{
+    uint64_t count_a = ((const profile_entry_t*)a)->count;
+    uint64_t count_b = ((const profile_entry_t*)b)->count;
+    if (count_a != count_b)
+        return count_a < count_b ? 1 : -1;
+    // ties in a fixed order, so the same run always prints the same list
+    return memcmp(((const profile_entry_t*)a)->ops, ((const profile_entry_t*)b)->ops, 3);
+}
+
+static void print_top(profile_entry_t* entries, int count, int length)
+{
+    qsort(entries, count, sizeof(profile_entry_t), compare_entries);
+
+    for (int i = 0; i < count && i < PROFILE_TOP; i++)
+    {
+        printf("%12llu %6.2f%%  ", (unsigned long long)entries[i].count, 100.0 * entries[i].count / profile_total);
+        for (int j = 0; j < length; j++)
+            printf(" %s", opcode_name(entries[i].ops[j]));
+        printf("\n");
+    }
+}
+
+void print_opcode_profile(void)
+{
+    profile_entry_t* entries = malloc(sizeof(profile_entry_t) * OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT);
+    if (entries == NULL)
+        return;
+
+    printf("=== opcode profile: %llu instructions ===\n", (unsigned long long)profile_total);
+
+    int count = 0;
+    for (int a = 0; a < OPCODE_COUNT; a++)
+        for (int b = 0; b < OPCODE_COUNT; b++)
+            if (profile_pairs[a][b] > 0)
+                entries[count++] = (profile_entry_t){ profile_pairs[a][b], { (uint8_t)a, (uint8_t)b, 0 } };
+    printf("pairs\n");
+    print_top(entries, count, 2);
+
+    count = 0;
+    for (int a = 0; a < OPCODE_COUNT; a++)
+        for (int b = 0; b < OPCODE_COUNT; b++)
+            for (int c = 0; c < OPCODE_COUNT; c++)
+                if (profile_triples[a][b][c] > 0)
+                    entries[count++] = (profile_entry_t){ profile_triples[a][b][c], { (uint8_t)a, (uint8_t)b, (uint8_t)c } };
+    printf("triples\n");
+    print_top(entries, count, 3);
+
+    free(entries);
+}
@@ -5,5 +5,11 @@
 
 void disassemble_chunk(chunk_t* chunk, const char* name);
 int disassemble_instruction(chunk_t* chunk, int offset);
+const char* opcode_name(uint8_t instruction);
+
+// counts executed opcode pairs and triples, the profiling interpreter loop calls this
+// before every instruction
+void profile_instruction(uint8_t instruction);
+void print_opcode_profile(void);
 
 #endif
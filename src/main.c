@@ -4,8 +4,10 @@
 #include <string.h>
 
 #include "common.h"
+#include "benchmark.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 #include <vld.h>
@@ -44,7 +46,7 @@ static char* read_file(const char* path)
     size_t file_size = ftell(file);
     rewind(file);
 
-    char* buffer = malloc(file_size + 1);
+    char* buffer = allocate_source(file_size + 1);
     if (!buffer)
     {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
@@ -67,8 +69,8 @@ static char* read_file(const char* path)
 static void run_file(interpreter_params_t* params)
 {
     char* source = read_file(params->file_path);
+    // the vm owns the source, string constants point into it
     interpret_result_t result = interpret(source, params);
-    free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) _EXIT(65);
     if (result == INTERPRET_RUNTIME_ERROR) _EXIT(70);
@@ -102,11 +104,33 @@ int main(int argc, const char* argv[])
     // path  file path
     // -te  trace execution
     // -pd  print disassembly
+    // -np  skip the peephole pass, to compare disassembly with and without it
+    // -ns  neither quicken nor fuse instructions, to profile the instructions the compiler emits
+    // -gcg <factor>  heap growth factor between collections
+    // -gcb <us>  time budget of an incremental collection step
+    // -gcs  print gc pause statistics at exit
+    // -gct <n>  number of threads marking in parallel
+    // -gcc  compact the heap after collections that freed most of it
+    // -hp  back the allocation pool with huge pages
+    // --mem-stats  print allocation and heap statistics at exit
+    // --bench-hash  compare the string hash functions and exit
+    // --op-profile  print the most frequent opcode pairs and triples at exit
 
     interpreter_params_t params;
     params.file_path = NULL;
     params.trace_execution = false;
     params.print_disassembly = false;
+    params.optimize_code = true;
+    params.specialize = true;
+    params.gc_grow_factor = GC_HEAP_GROW_FACTOR;
+    params.gc_step_budget_us = 0;
+    params.print_gc_stats = false;
+    params.gc_threads = 1;
+    params.gc_compact = false;
+    params.huge_pages = false;
+    params.print_mem_stats = false;
+    params.profile_opcodes = false;
+    bool bench_hash = false;
 
     for (int i = 1; i < argc; i++)
     {
@@ -118,6 +142,65 @@ int main(int argc, const char* argv[])
         {
             params.print_disassembly = true;
         }
+        else if (strcmp("-np", argv[i]) == 0)
+        {
+            params.optimize_code = false;
+        }
+        else if (strcmp("-ns", argv[i]) == 0)
+        {
+            params.specialize = false;
+        }
+        else if (strcmp("-gcg", argv[i]) == 0 && i + 1 < argc)
+        {
+            params.gc_grow_factor = atof(argv[++i]);
+            if (params.gc_grow_factor <= 1.0)
+            {
+                printf("gc growth factor has to be greater than 1\n");
+                return 1;
+            }
+        }
+        else if (strcmp("-gcb", argv[i]) == 0 && i + 1 < argc)
+        {
+            params.gc_step_budget_us = atoi(argv[++i]);
+            if (params.gc_step_budget_us <= 0)
+            {
+                printf("gc step budget has to be a positive number of microseconds\n");
+                return 1;
+            }
+        }
+        else if (strcmp("-gct", argv[i]) == 0 && i + 1 < argc)
+        {
+            params.gc_threads = atoi(argv[++i]);
+            if (params.gc_threads < 1 || params.gc_threads > GC_MAX_THREADS)
+            {
+                printf("gc thread count has to be between 1 and %d\n", GC_MAX_THREADS);
+                return 1;
+            }
+        }
+        else if (strcmp("-gcc", argv[i]) == 0)
+        {
+            params.gc_compact = true;
+        }
+        else if (strcmp("-hp", argv[i]) == 0)
+        {
+            params.huge_pages = true;
+        }
+        else if (strcmp("--mem-stats", argv[i]) == 0)
+        {
+            params.print_mem_stats = true;
+        }
+        else if (strcmp("--op-profile", argv[i]) == 0)
+        {
+            params.profile_opcodes = true;
+        }
+        else if (strcmp("--bench-hash", argv[i]) == 0)
+        {
+            bench_hash = true;
+        }
+        else if (strcmp("-gcs", argv[i]) == 0)
+        {
+            params.print_gc_stats = true;
+        }
         else if (argv[i][0] != '-' && params.file_path == NULL)
         {
             params.file_path = argv[i];
@@ -125,14 +208,18 @@ int main(int argc, const char* argv[])
         else
         {
             printf("unknown parameter '%s'\n", argv[i]);
-            printf("usage: clox [path] [-te] [-pd]\n");
+            printf("usage: clox [path] [-te] [-pd] [-np] [-ns] [-gcg factor] [-gcb us] [-gct threads] [-gcc] [-gcs] [-hp] [--mem-stats] [--op-profile] [--bench-hash]\n");
             return 1;
         }
     }
 
     init_vm();
 
-    if (params.file_path == NULL)
+    if (bench_hash)
+    {
+        benchmark_hash();
+    }
+    else if (params.file_path == NULL)
     {
         repl(&params);
     }
@@ -141,6 +228,13 @@ int main(int argc, const char* argv[])
         run_file(&params);
     }
 
+    if (params.print_gc_stats)
+        print_gc_stats();
+    if (params.print_mem_stats)
+        print_mem_stats();
+    if (params.profile_opcodes)
+        print_opcode_profile();
+
     free_vm();
 
     return 0;
@@ -1,11 +1,76 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "common.h"
+#include "compiler.h"
 #include "memory.h"
+#include "pool.h"
+#include "table.h"
+#include "thread.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+#ifdef _WIN32
+#include <psapi.h>
+#endif
+
+static void maybe_collect(void);
+
+const char* ALLOC_SITE_NAMES[] = {
+    "runtime",
+    "compiler",
+    "native"
+};
+
+const char* OBJ_TYPE_NAMES[] = {
+    "function",
+    "closure",
+    "native",
+    "string",
+    "upvalue",
+    "rope"
+};
+
+static void track_allocated(size_t size)
+{
+    vm.bytes_allocated += size;
+    vm.mem_stats.total_allocated += size;
+    vm.mem_stats.site_bytes[vm.alloc_site] += size;
+    if (vm.bytes_allocated > vm.mem_stats.peak)
+        vm.mem_stats.peak = vm.bytes_allocated;
+}
+
+static void track_freed(size_t size)
+{
+    vm.bytes_allocated -= size;
+    vm.mem_stats.total_freed += size;
+}
+
+void count_object(obj_type_t type, int delta)
+{
+    vm.mem_stats.live_objects[type] += delta;
+    if (delta > 0)
+        vm.mem_stats.total_objects[type] += delta;
+}
+
 void* reallocate(void* previous, size_t old_size, size_t new_size)
 {
+    if (new_size > old_size)
+        track_allocated(new_size - old_size);
+    else
+        track_freed(old_size - new_size);
+    if (previous == NULL && new_size > 0)
+        vm.mem_stats.site_allocations[vm.alloc_site]++;
+
+    if (new_size > old_size)
+        maybe_collect();
+
+#ifdef USE_SYSTEM_ALLOCATOR
     if (new_size == 0)
     {
         free(previous);
@@ -13,43 +78,1424 @@ void* reallocate(void* previous, size_t old_size, size_t new_size)
     }
 
     return realloc(previous, new_size);
+#else
+    return pool_reallocate(previous, old_size, new_size);
+#endif
+}
+
+#ifdef GC_GENERATIONAL
+
+#define ALIGN_SIZE(size) (((size) + 7) & ~(size_t)7)
+#define BLOCK_DATA_OFFSET ALIGN_SIZE(sizeof(nursery_block_t))
+
+static nursery_block_t* new_block(nursery_block_t* next)
+{
+    nursery_block_t* block = vm.nursery.free_blocks;
+    if (block != NULL)
+    {
+        vm.nursery.free_blocks = block->next;
+    }
+    else
+    {
+        block = malloc(NURSERY_BLOCK_SIZE);
+        if (block == NULL)
+            exit(1);
+    }
+
+    block->next = next;
+    block->top = (uint8_t*)block + BLOCK_DATA_OFFSET;
+    block->end = (uint8_t*)block + NURSERY_BLOCK_SIZE;
+    return block;
+}
+
+static void delete_blocks(nursery_block_t* block)
+{
+    while (block != NULL)
+    {
+        nursery_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void init_nursery(nursery_t* nursery)
+{
+    nursery->free_blocks = NULL;
+    nursery->blocks = new_block(NULL);
+    nursery->block_count = 1;
+    nursery->minor_pending = false;
+    nursery->allocated_at_full = 0;
+    nursery->young_objects = NULL;
+    nursery->remembered_count = 0;
+    nursery->remembered_capacity = 0;
+    nursery->remembered = NULL;
+    nursery->collecting_minor = false;
+}
+
+// every object has left the nursery. blocks it grew by while waiting for a safepoint go back
+// to libc, the usual number is kept for reuse
+static void reset_nursery(void)
+{
+    nursery_t* nursery = &vm.nursery;
+
+    int kept = 0;
+    nursery_block_t* block = nursery->blocks;
+    while (block != NULL)
+    {
+        nursery_block_t* next = block->next;
+        if (kept < NURSERY_BLOCKS)
+        {
+            block->next = nursery->free_blocks;
+            nursery->free_blocks = block;
+            kept++;
+        }
+        else
+        {
+            free(block);
+        }
+        block = next;
+    }
+
+    nursery->blocks = new_block(NULL);
+    nursery->block_count = 1;
+    nursery->minor_pending = false;
+}
+
+static void* nursery_allocate(size_t size)
+{
+    nursery_t* nursery = &vm.nursery;
+
+#ifdef DEBUG_STRESS_GC
+    nursery->minor_pending = true;
+#endif
+
+    nursery_block_t* block = nursery->blocks;
+    if (block->top + size > block->end)
+    {
+        block = new_block(block);
+        nursery->blocks = block;
+        if (++nursery->block_count >= NURSERY_BLOCKS)
+            nursery->minor_pending = true;
+    }
+
+    void* memory = block->top;
+    block->top += size;
+    return memory;
+}
+
+void* allocate_object_memory(size_t size)
+{
+    if (size > NURSERY_MAX_OBJECT)
+        return reallocate(NULL, 0, size);
+
+    size = ALIGN_SIZE(size);
+    track_allocated(size);
+    vm.mem_stats.site_allocations[vm.alloc_site]++;
+    // collections started here can not move objects, young survivors wait for a safepoint
+    maybe_collect();
+    return nursery_allocate(size);
+}
+
+static void release_object(obj_t* obj, size_t size)
+{
+    if (obj->in_page)
+    {
+        track_freed(size);
+        PAGE_OF(obj)->live--;
+        return;
+    }
+
+    if (!obj->in_nursery)
+    {
+        reallocate(obj, size, 0);
+        return;
+    }
+
+    // the block is reused as a whole after the next minor collection
+    track_freed(ALIGN_SIZE(size));
+}
+
+void remember_object(obj_t* obj)
+{
+    nursery_t* nursery = &vm.nursery;
+
+    if (nursery->remembered_capacity < nursery->remembered_count + 1)
+    {
+        nursery->remembered_capacity = GROW_CAPACITY(nursery->remembered_capacity);
+        nursery->remembered = realloc(nursery->remembered, sizeof(obj_t*) * nursery->remembered_capacity);
+        if (nursery->remembered == NULL)
+            exit(1);
+    }
+
+    obj->is_remembered = true;
+    nursery->remembered[nursery->remembered_count++] = obj;
+}
+
+#else
+
+void* allocate_object_memory(size_t size)
+{
+    return reallocate(NULL, 0, size);
+}
+
+static void release_object(obj_t* obj, size_t size)
+{
+    if (obj->in_page)
+    {
+        track_freed(size);
+        PAGE_OF(obj)->live--;
+        return;
+    }
+
+    reallocate(obj, size, 0);
+}
+
+#endif
+
+#define FREE_OBJ(type, obj) release_object((obj_t*)(obj), sizeof(type))
+
+static void push_gray(obj_t* obj);
+
+#ifndef GC_INCREMENTAL
+static void mark_object_parallel(obj_t* obj);
+static void free_empty_pages(void);
+// set while a thread takes part in a parallel mark
+static THREAD_LOCAL struct smark_worker_t* current_worker = NULL;
+#endif
+
+void mark_object(obj_t* obj)
+{
+    if (obj == NULL)
+        return;
+
+#ifdef GC_GENERATIONAL
+    // a minor collection treats every old object as reachable
+    if (vm.nursery.collecting_minor && obj->is_old)
+        return;
+#endif
+
+#ifndef GC_INCREMENTAL
+    if (current_worker != NULL)
+    {
+        mark_object_parallel(obj);
+        return;
+    }
+#endif
+
+    if (obj->is_marked)
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)obj);
+    print_value(OBJ_VAL(obj));
+    printf("\n");
+#endif
+
+    obj->is_marked = true;
+    push_gray(obj);
+}
+
+static void push_gray(obj_t* obj)
+{
+#ifdef GC_INCREMENTAL
+    obj->is_gray = true;
+#endif
+
+    if (vm.gray_capacity < vm.gray_count + 1)
+    {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        // the gray stack is bookkeeping of the collector itself,
+        // so it does not go through reallocate()
+        vm.gray_stack = realloc(vm.gray_stack, sizeof(obj_t*) * vm.gray_capacity);
+        if (vm.gray_stack == NULL)
+            exit(1);
+    }
+
+    vm.gray_stack[vm.gray_count++] = obj;
+}
+
+void mark_value(value_t value)
+{
+    if (IS_OBJ(value))
+        mark_object(AS_OBJ(value));
+}
+
+static void mark_array(value_array_t* array)
+{
+    for (int i = 0; i < array->count; i++)
+        mark_value(array->values[i]);
+}
+
+static void blacken_object(obj_t* obj)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)obj);
+    print_value(OBJ_VAL(obj));
+    printf("\n");
+#endif
+
+#ifdef GC_INCREMENTAL
+    obj->is_gray = false;
+#endif
+
+    switch (obj->type)
+    {
+    case OBJ_FUNCTION: {
+        obj_function_t* func = (obj_function_t*)obj;
+        mark_object((obj_t*)func->name);
+        mark_object((obj_t*)func->closure);
+        mark_array(&func->chunk.constants);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        obj_closure_t* clos = (obj_closure_t*)obj;
+        mark_object((obj_t*)clos->function);
+        for (int i = 0; i < clos->upvalueCount; i++)
+            mark_object((obj_t*)clos->upvalues[i]);
+        break;
+    }
+    case OBJ_ROPE: {
+        obj_rope_t* rope = (obj_rope_t*)obj;
+        mark_object(rope->left);
+        mark_object(rope->right);
+        mark_object((obj_t*)rope->flat);
+        break;
+    }
+    case OBJ_UPVALUE:
+        mark_value(((obj_upvalue_t*)obj)->closed);
+        break;
+    case OBJ_STRING:
+        mark_object((obj_t*)((obj_string_t*)obj)->parent);
+        break;
+    case OBJ_NATIVE:
+        break;
+    }
 }
 
 static void free_object(obj_t* obj)
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)obj, obj->type);
+#endif
+
+    count_object(obj->type, -1);
+
     switch (obj->type)
     {
     case OBJ_FUNCTION: {
         obj_function_t* func = (obj_function_t*)obj;
         free_chunk(&(func->chunk));
-        FREE(obj_function_t, func);
+        FREE_OBJ(obj_function_t, func);
         break;
     }
     case OBJ_CLOSURE: {
-        obj_closure_t* clos = (obj_closure_t*)obj;
-        FREE_ARRAY(value_t, clos->upvalues, clos->upvalueCount);
-        FREE(obj_closure_t, clos);
+        release_object(obj, CLOSURE_SIZE(((obj_closure_t*)obj)->upvalueCount));
         break;
     }
     case OBJ_NATIVE: {
-        FREE(obj_native_t, obj);
+        FREE_OBJ(obj_native_t, obj);
         break;
     }
     case OBJ_STRING: {
-        obj_string_t* str = (obj_string_t*)obj;
-        FREE_ARRAY(char, str->chars, str->length + 1);
-        FREE(obj_string_t, obj);
+        release_object(obj, STRING_OBJECT_SIZE((obj_string_t*)obj));
         break;
     }
     case OBJ_UPVALUE:
-        FREE(obj_upvalue_t, obj);
+        FREE_OBJ(obj_upvalue_t, obj);
+        break;
+    case OBJ_ROPE:
+        FREE_OBJ(obj_rope_t, obj);
+        break;
+    }
+}
+
+// roots that are written without barriers
+static void mark_vm_roots(void)
+{
+    for (value_t* slot = vm.stack; slot < vm.stack_top; slot++)
+        mark_value(*slot);
+
+    for (int i = 0; i < vm.frame_count; i++)
+        mark_object((obj_t*)vm.frames[i].closure);
+
+    for (obj_upvalue_t* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        mark_object((obj_t*)upvalue);
+
+    mark_compiler_roots();
+}
+
+static void mark_roots(void)
+{
+    mark_vm_roots();
+    mark_table(&vm.global_names);
+    mark_array(&vm.global_values);
+}
+
+static void trace_references(void)
+{
+    while (vm.gray_count > 0)
+    {
+        obj_t* obj = vm.gray_stack[--vm.gray_count];
+        blacken_object(obj);
+    }
+}
+
+#ifndef GC_INCREMENTAL
+
+// each worker traces from a private stack and shares the older half of it once it grows
+// past MARK_LOCAL_MAX. idle workers steal half of another worker's shared stack.
+#define MARK_LOCAL_MAX 256
+
+typedef struct smark_worker_t {
+    obj_t** local;
+    int local_count;
+
+    mutex_t lock;
+    obj_t** shared;
+    int shared_count;
+    int shared_capacity;
+} mark_worker_t;
+
+typedef struct {
+    int count;
+    thread_t* threads;
+    mark_worker_t* workers;
+
+    mutex_t lock;
+    cond_t start;
+    cond_t done;
+    int generation;
+    int finished;
+    bool shutdown;
+
+    // workers that hold or may still produce gray objects
+    long active;
+} mark_pool_t;
+
+static mark_pool_t pool;
+
+static void grow_shared(mark_worker_t* worker, int needed)
+{
+    if (worker->shared_capacity >= needed)
+        return;
+
+    while (worker->shared_capacity < needed)
+        worker->shared_capacity = GROW_CAPACITY(worker->shared_capacity);
+    worker->shared = realloc(worker->shared, sizeof(obj_t*) * worker->shared_capacity);
+    if (worker->shared == NULL)
+        exit(1);
+}
+
+static void publish_work(mark_worker_t* worker)
+{
+    int half = worker->local_count / 2;
+
+    mutex_lock(&worker->lock);
+    grow_shared(worker, worker->shared_count + half);
+    memcpy(worker->shared + worker->shared_count, worker->local, sizeof(obj_t*) * half);
+    worker->shared_count += half;
+    mutex_unlock(&worker->lock);
+
+    memmove(worker->local, worker->local + half, sizeof(obj_t*) * (worker->local_count - half));
+    worker->local_count -= half;
+}
+
+static void mark_object_parallel(obj_t* obj)
+{
+    if (atomic_load_bool(&obj->is_marked) || atomic_exchange_bool(&obj->is_marked))
+        return;
+
+    mark_worker_t* worker = current_worker;
+    if (worker->local_count == MARK_LOCAL_MAX)
+        publish_work(worker);
+    worker->local[worker->local_count++] = obj;
+}
+
+// moves up to half of the victims shared objects onto the local stack of the thief
+static bool steal_work(mark_worker_t* thief, mark_worker_t* victim)
+{
+    mutex_lock(&victim->lock);
+    int count = (victim->shared_count + 1) / 2;
+    if (count > MARK_LOCAL_MAX / 2)
+        count = MARK_LOCAL_MAX / 2;
+    victim->shared_count -= count;
+    memcpy(thief->local, victim->shared + victim->shared_count, sizeof(obj_t*) * count);
+    mutex_unlock(&victim->lock);
+
+    thief->local_count = count;
+    return count > 0;
+}
+
+static bool find_work(int index)
+{
+    mark_worker_t* self = pool.workers + index;
+    if (steal_work(self, self))
+        return true;
+
+    for (int i = 1; i < pool.count; i++)
+    {
+        if (steal_work(self, pool.workers + (index + i) % pool.count))
+            return true;
+    }
+    return false;
+}
+
+static void run_mark_worker(int index)
+{
+    mark_worker_t* worker = pool.workers + index;
+    current_worker = worker;
+
+    for (;;)
+    {
+        while (worker->local_count > 0)
+            blacken_object(worker->local[--worker->local_count]);
+
+        if (find_work(index))
+            continue;
+
+        // nothing left here, wait until someone shares work or everybody ran dry
+        atomic_decrement(&pool.active);
+        for (;;)
+        {
+            if (atomic_load_int(&pool.active) == 0)
+            {
+                current_worker = NULL;
+                return;
+            }
+
+            atomic_increment(&pool.active);
+            if (find_work(index))
+                break;
+            atomic_decrement(&pool.active);
+            thread_yield();
+        }
+    }
+}
+
+static void mark_thread_main(void* arg)
+{
+    int index = (int)(intptr_t)arg;
+    int seen = 0;
+
+    for (;;)
+    {
+        mutex_lock(&pool.lock);
+        while (pool.generation == seen && !pool.shutdown)
+            cond_wait(&pool.start, &pool.lock);
+        if (pool.shutdown)
+        {
+            mutex_unlock(&pool.lock);
+            return;
+        }
+        seen = pool.generation;
+        mutex_unlock(&pool.lock);
+
+        run_mark_worker(index);
+
+        mutex_lock(&pool.lock);
+        if (++pool.finished == pool.count - 1)
+            cond_broadcast(&pool.done);
+        mutex_unlock(&pool.lock);
+    }
+}
+
+static void stop_mark_pool(void)
+{
+    if (pool.count == 0)
+        return;
+
+    mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    cond_broadcast(&pool.start);
+    mutex_unlock(&pool.lock);
+
+    for (int i = 1; i < pool.count; i++)
+        thread_join(pool.threads[i]);
+
+    for (int i = 0; i < pool.count; i++)
+    {
+        mutex_destroy(&pool.workers[i].lock);
+        free(pool.workers[i].local);
+        free(pool.workers[i].shared);
+    }
+    free(pool.workers);
+    free(pool.threads);
+
+    mutex_destroy(&pool.lock);
+    cond_destroy(&pool.start);
+    cond_destroy(&pool.done);
+    pool.count = 0;
+}
+
+static bool start_mark_pool(int count)
+{
+    pool.count = count;
+    pool.generation = 0;
+    pool.finished = 0;
+    pool.shutdown = false;
+    pool.threads = calloc(count, sizeof(thread_t));
+    pool.workers = calloc(count, sizeof(mark_worker_t));
+    if (pool.threads == NULL || pool.workers == NULL)
+        exit(1);
+
+    mutex_init(&pool.lock);
+    cond_init(&pool.start);
+    cond_init(&pool.done);
+
+    for (int i = 0; i < count; i++)
+    {
+        mutex_init(&pool.workers[i].lock);
+        pool.workers[i].local = malloc(sizeof(obj_t*) * MARK_LOCAL_MAX);
+        if (pool.workers[i].local == NULL)
+            exit(1);
+    }
+
+    // the collecting thread is worker 0
+    for (int i = 1; i < count; i++)
+    {
+        if (!thread_start(&pool.threads[i], mark_thread_main, (void*)(intptr_t)i))
+        {
+            pool.count = i;
+            stop_mark_pool();
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool trace_references_parallel(void)
+{
+    if (pool.count != vm.gc_threads)
+    {
+        stop_mark_pool();
+        if (!start_mark_pool(vm.gc_threads))
+            return false;
+    }
+
+    // hand the gray roots out round robin
+    for (int i = 0; i < vm.gray_count; i++)
+    {
+        mark_worker_t* worker = pool.workers + i % pool.count;
+        grow_shared(worker, worker->shared_count + 1);
+        worker->shared[worker->shared_count++] = vm.gray_stack[i];
+    }
+    vm.gray_count = 0;
+
+    pool.active = pool.count;
+
+    mutex_lock(&pool.lock);
+    pool.finished = 0;
+    pool.generation++;
+    cond_broadcast(&pool.start);
+    mutex_unlock(&pool.lock);
+
+    run_mark_worker(0);
+
+    mutex_lock(&pool.lock);
+    while (pool.finished < pool.count - 1)
+        cond_wait(&pool.done, &pool.lock);
+    mutex_unlock(&pool.lock);
+
+    return true;
+}
+
+// the incremental collector sweeps in steps with sweep_one
+static void sweep(void)
+{
+    obj_t* previous = NULL;
+    obj_t* obj = vm.objects;
+
+    while (obj != NULL)
+    {
+        if (obj->is_marked)
+        {
+            obj->is_marked = false;
+            previous = obj;
+            obj = obj->next;
+        }
+        else
+        {
+            obj_t* unreached = obj;
+            obj = obj->next;
+
+            if (previous != NULL)
+                previous->next = obj;
+            else
+                vm.objects = obj;
+
+            free_object(unreached);
+        }
+    }
+}
+
+#endif
+
+bool is_object_live(obj_t* obj)
+{
+#ifdef GC_GENERATIONAL
+    if (vm.nursery.collecting_minor && obj->is_old)
+        return true;
+#endif
+    return obj->is_marked;
+}
+
+static void update_threshold(void)
+{
+    vm.next_gc = (size_t)(vm.bytes_allocated * vm.gc_grow_factor);
+    if (vm.next_gc < GC_INITIAL_HEAP)
+        vm.next_gc = GC_INITIAL_HEAP;
+
+#ifndef USE_SYSTEM_ALLOCATOR
+    // the heap grows back into this much before the next collection, the rest is returned
+    pool_trim(vm.next_gc - vm.bytes_allocated);
+#endif
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void record_pause(uint64_t us)
+{
+    gc_pause_stats_t* stats = &vm.gc_pauses;
+    stats->count++;
+    stats->total_us += us;
+    if (us > stats->max_us)
+        stats->max_us = us;
+
+    uint64_t bucket = us < GC_PAUSE_FINE_BUCKETS ? us : GC_PAUSE_FINE_BUCKETS + (us - GC_PAUSE_FINE_BUCKETS) / 1000;
+    if (bucket >= GC_PAUSE_BUCKETS)
+        bucket = GC_PAUSE_BUCKETS - 1;
+    stats->histogram[bucket]++;
+}
+
+// upper bound of the pause length below which the given percentage of pauses fall
+uint64_t gc_pause_percentile(double percentile)
+{
+    gc_pause_stats_t* stats = &vm.gc_pauses;
+    if (stats->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(stats->count * percentile / 100.0);
+    if (rank >= stats->count)
+        rank = stats->count - 1;
+
+    uint64_t seen = 0;
+    for (uint64_t bucket = 0; bucket < GC_PAUSE_BUCKETS; bucket++)
+    {
+        seen += stats->histogram[bucket];
+        if (seen > rank)
+        {
+            if (bucket < GC_PAUSE_FINE_BUCKETS)
+                return bucket;
+            return GC_PAUSE_FINE_BUCKETS + (bucket - GC_PAUSE_FINE_BUCKETS + 1) * 1000;
+        }
+    }
+    return stats->max_us;
+}
+
+void print_gc_stats(void)
+{
+    gc_pause_stats_t* stats = &vm.gc_pauses;
+
+    printf("-------- gc pauses ---------\n");
+    printf("count  %llu\n", (unsigned long long)stats->count);
+    printf("total  %llu us\n", (unsigned long long)stats->total_us);
+    printf("max    %llu us\n", (unsigned long long)stats->max_us);
+    printf("p50    %llu us\n", (unsigned long long)gc_pause_percentile(50.0));
+    printf("p99    %llu us\n", (unsigned long long)gc_pause_percentile(99.0));
+    printf("----------------------------\n");
+}
+
+void resident_bytes(size_t* now, size_t* peak)
+{
+    *now = 0;
+    *peak = 0;
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        *now = counters.WorkingSetSize;
+        *peak = counters.PeakWorkingSetSize;
+    }
+#else
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file == NULL)
+        return;
+
+    char line[128];
+    size_t kilobytes;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %zu kB", &kilobytes) == 1)
+            *now = kilobytes * 1024;
+        else if (sscanf(line, "VmHWM: %zu kB", &kilobytes) == 1)
+            *peak = kilobytes * 1024;
+    }
+    fclose(file);
+#endif
+}
+
+void print_mem_stats(void)
+{
+    mem_stats_t* stats = &vm.mem_stats;
+    size_t resident, peak_resident;
+    resident_bytes(&resident, &peak_resident);
+
+    printf("-------- memory ------------\n");
+    printf("live       %zu bytes\n", vm.bytes_allocated);
+    printf("peak       %zu bytes\n", stats->peak);
+    printf("allocated  %zu bytes\n", stats->total_allocated);
+    printf("freed      %zu bytes\n", stats->total_freed);
+#ifndef USE_SYSTEM_ALLOCATOR
+    printf("pool       %zu bytes mapped, %zu at most\n", pool_mapped_bytes(), pool_peak_mapped_bytes());
+#endif
+    printf("resident   %zu bytes, %zu at most\n", resident, peak_resident);
+
+    printf("allocations by site:\n");
+    for (int i = 0; i < ALLOC_SITE_COUNT; i++)
+    {
+        printf("  %-10s %10llu %12zu bytes\n", ALLOC_SITE_NAMES[i],
+            (unsigned long long)stats->site_allocations[i], stats->site_bytes[i]);
+    }
+
+    printf("objects by type (live / total):\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        printf("  %-10s %10lld / %llu\n", OBJ_TYPE_NAMES[i],
+            (long long)stats->live_objects[i], (unsigned long long)stats->total_objects[i]);
+    }
+    printf("----------------------------\n");
+}
+
+#ifdef GC_INCREMENTAL
+
+// work is done in chunks of this many units between two looks at the clock
+#define GC_WORK_CHUNK 64
+
+void regray_object(obj_t* obj)
+{
+    if (vm.gc_phase == GC_PHASE_MARK)
+        push_gray(obj);
+}
+
+static void start_cycle(void)
+{
+    vm.gc_phase = GC_PHASE_MARK;
+    mark_roots();
+}
+
+static void finish_mark(void)
+{
+    // the stack and the compiler are written without barriers, scan them again in one go
+    mark_vm_roots();
+    trace_references();
+
+    vm.gc_phase = GC_PHASE_WEAK;
+    vm.gc_weak_index = 0;
+    vm.gc_weak_capacity = vm.strings.capacity;
+}
+
+static void sweep_one(void)
+{
+    obj_t* obj = vm.sweep_current;
+    vm.sweep_current = obj->next;
+
+    if (obj->is_marked)
+    {
+        obj->is_marked = false;
+        vm.sweep_previous = obj;
+        return;
+    }
+
+    if (vm.sweep_previous != NULL)
+        vm.sweep_previous->next = obj->next;
+    else
+        vm.objects = obj->next;
+
+    free_object(obj);
+}
+
+static void incremental_work(int units)
+{
+    switch (vm.gc_phase)
+    {
+    case GC_PHASE_MARK:
+        while (units-- > 0 && vm.gray_count > 0)
+            blacken_object(vm.gray_stack[--vm.gray_count]);
+
+        if (vm.gray_count == 0)
+            finish_mark();
+        break;
+
+    case GC_PHASE_WEAK: {
+        // growing the table rehashes it, start over
+        if (vm.strings.capacity != vm.gc_weak_capacity)
+        {
+            vm.gc_weak_index = 0;
+            vm.gc_weak_capacity = vm.strings.capacity;
+        }
+
+        int end = vm.gc_weak_index + units;
+        if (end > vm.gc_weak_capacity)
+            end = vm.gc_weak_capacity;
+        table_remove_white_range(&vm.strings, vm.gc_weak_index, end);
+        vm.gc_weak_index = end;
+
+        if (vm.gc_weak_index >= vm.gc_weak_capacity)
+        {
+            table_tidy(&vm.strings);
+            vm.gc_phase = GC_PHASE_SWEEP;
+            vm.sweep_previous = NULL;
+            vm.sweep_current = vm.objects;
+        }
         break;
     }
+
+    case GC_PHASE_SWEEP:
+        while (units-- > 0 && vm.sweep_current != NULL)
+            sweep_one();
+
+        if (vm.sweep_current == NULL)
+        {
+            vm.gc_phase = GC_PHASE_IDLE;
+            update_threshold();
+        }
+        break;
+
+    case GC_PHASE_IDLE:
+        break;
+    }
+}
+
+void gc_step(void)
+{
+    uint64_t start = now_us();
+
+    if (vm.gc_phase == GC_PHASE_IDLE)
+        start_cycle();
+
+    do {
+        incremental_work(GC_WORK_CHUNK);
+    } while (vm.gc_phase != GC_PHASE_IDLE && now_us() - start < vm.gc_step_budget_us);
+
+    vm.gc_next_step = vm.bytes_allocated + GC_STEP_SIZE;
+    vm.gc_backedges = 0;
+
+    record_pause(now_us() - start);
+}
+
+#endif
+
+static void maybe_collect(void)
+{
+#ifdef GC_INCREMENTAL
+#ifdef DEBUG_STRESS_GC
+    // a single unit of work per allocation interleaves collector and program as much as possible
+    if (vm.gc_phase == GC_PHASE_IDLE)
+        start_cycle();
+    incremental_work(1);
+#else
+    if (vm.gc_phase == GC_PHASE_IDLE ? vm.bytes_allocated > vm.next_gc : vm.bytes_allocated >= vm.gc_next_step)
+        gc_step();
+#endif
+#else
+#ifdef DEBUG_STRESS_GC
+    collect_garbage();
+#endif
+
+    if (vm.bytes_allocated > vm.next_gc)
+        collect_garbage();
+#endif
+}
+
+#ifdef GC_GENERATIONAL
+
+static void evacuate_young(void);
+
+// young objects that survive a full collection stay in the nursery, collections started at an
+// allocation can not move them. the next minor collection does at a safepoint
+static void sweep_young(void)
+{
+    obj_t* previous = NULL;
+    obj_t* obj = vm.nursery.young_objects;
+
+    while (obj != NULL)
+    {
+        if (obj->is_marked)
+        {
+            obj->is_marked = false;
+            previous = obj;
+            obj = obj->next;
+        }
+        else
+        {
+            obj_t* unreached = obj;
+            obj = obj->next;
+
+            if (previous != NULL)
+                previous->next = obj;
+            else
+                vm.nursery.young_objects = obj;
+
+            free_object(unreached);
+        }
+    }
+}
+
+// old objects in the remembered set can die in a full collection, the survivors among them
+// may still point at young objects
+static void prune_remembered(void)
+{
+    nursery_t* nursery = &vm.nursery;
+    int kept = 0;
+    for (int i = 0; i < nursery->remembered_count; i++)
+    {
+        if (nursery->remembered[i]->is_marked)
+            nursery->remembered[kept++] = nursery->remembered[i];
+    }
+    nursery->remembered_count = kept;
+}
+
+static void forget_remembered(void)
+{
+    for (int i = 0; i < vm.nursery.remembered_count; i++)
+        vm.nursery.remembered[i]->is_remembered = false;
+    vm.nursery.remembered_count = 0;
+}
+
+void collect_minor(void)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+    uint64_t start = now_us();
+
+    vm.nursery.collecting_minor = true;
+
+    mark_roots();
+    for (int i = 0; i < vm.nursery.remembered_count; i++)
+        blacken_object(vm.nursery.remembered[i]);
+    trace_references();
+
+    table_remove_white(&vm.strings);
+    table_tidy(&vm.strings);
+    vm.nursery.collecting_minor = false;
+
+    evacuate_young();
+    forget_remembered();
+    reset_nursery();
+
+    uint64_t pause = now_us() - start;
+    record_pause(pause);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) in %llu us\n",
+        before - vm.bytes_allocated, before, vm.bytes_allocated, (unsigned long long)pause);
+#endif
+
+    // old objects only die in full collections. a program that stopped promoting never grows the
+    // old heap to its threshold, so one also runs after allocating that much since the last
+    if (vm.bytes_allocated > vm.next_gc || vm.mem_stats.total_allocated - vm.nursery.allocated_at_full > vm.next_gc)
+        collect_garbage();
 }
 
-void free_objects()
+#endif
+
+void collect_garbage(void)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+    uint64_t start = now_us();
+
+#ifdef GC_INCREMENTAL
+    // finish the running cycle without a time limit
+    if (vm.gc_phase == GC_PHASE_IDLE)
+        start_cycle();
+    while (vm.gc_phase != GC_PHASE_IDLE)
+        incremental_work(INT32_MAX);
+#else
+    size_t before_collection = vm.bytes_allocated;
+
+    mark_roots();
+    if (vm.gc_threads <= 1 || vm.bytes_allocated < GC_PARALLEL_MIN_HEAP || !trace_references_parallel())
+        trace_references();
+    // the intern table holds its strings weakly
+    table_remove_white(&vm.strings);
+    table_tidy(&vm.strings);
+
+#ifdef GC_GENERATIONAL
+    prune_remembered();
+    sweep();
+    sweep_young();
+    vm.nursery.allocated_at_full = vm.mem_stats.total_allocated;
+#else
+    sweep();
+#endif
+    free_empty_pages();
+
+    update_threshold();
+
+    // move the survivors together once a collection freed at least as much as it kept
+#ifdef DEBUG_STRESS_GC
+    vm.compact_pending = vm.gc_compact;
+    (void)before_collection;
+#else
+    if (vm.gc_compact && before_collection - vm.bytes_allocated >= vm.bytes_allocated)
+        vm.compact_pending = true;
+#endif
+#endif
+
+    record_pause(now_us() - start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+        before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+#endif
+}
+
+#ifndef GC_INCREMENTAL
+
+#define PAGE_ALIGN(size) (((size) + 15) & ~(size_t)15)
+#define PAGE_DATA_OFFSET PAGE_ALIGN(sizeof(heap_page_t))
+
+static size_t object_size(obj_t* obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_FUNCTION: return sizeof(obj_function_t);
+    case OBJ_CLOSURE: return CLOSURE_SIZE(((obj_closure_t*)obj)->upvalueCount);
+    case OBJ_NATIVE: return sizeof(obj_native_t);
+    case OBJ_STRING: return STRING_OBJECT_SIZE((obj_string_t*)obj);
+    case OBJ_UPVALUE: return sizeof(obj_upvalue_t);
+    case OBJ_ROPE: return sizeof(obj_rope_t);
+    }
+    return 0;
+}
+
+static heap_page_t* new_page(heap_page_t* next, size_t min_size)
+{
+    size_t size = HEAP_PAGE_SIZE;
+    if (PAGE_DATA_OFFSET + min_size > size)
+        size = (PAGE_DATA_OFFSET + min_size + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+
+    // mapped from the os, libc would keep freed pages around for its own use
+    heap_page_t* page = pool_map_aligned(size, HEAP_PAGE_SIZE);
+    if (page == NULL)
+        exit(1);
+
+    page->next = next;
+    page->used = PAGE_DATA_OFFSET;
+    page->size = size;
+    page->live = 0;
+    return page;
+}
+
+static void free_pages(heap_page_t* page)
+{
+    while (page != NULL)
+    {
+        heap_page_t* next = page->next;
+        pool_unmap(page, page->size);
+        page = next;
+    }
+}
+
+static void free_empty_pages(void)
+{
+    heap_page_t* previous = NULL;
+    heap_page_t* page = vm.pages;
+
+    while (page != NULL)
+    {
+        heap_page_t* next = page->next;
+        if (page->live == 0)
+        {
+            if (previous != NULL)
+                previous->next = next;
+            else
+                vm.pages = next;
+            pool_unmap(page, page->size);
+        }
+        else
+        {
+            previous = page;
+        }
+        page = next;
+    }
+}
+
+// an object that was moved keeps the address of its copy in its next field
+static obj_t* forward_object(obj_t* obj)
+{
+    return obj == NULL ? NULL : obj->next;
+}
+
+static value_t forward_value(value_t value, obj_t* (*forward)(obj_t* obj))
+{
+    return IS_OBJ(value) ? OBJ_VAL(forward(AS_OBJ(value))) : value;
+}
+
+// fields that point into the object itself, they have to follow the copy right away
+static void fix_interior(obj_t* copy, obj_t* original)
+{
+    if (copy->type == OBJ_UPVALUE)
+    {
+        // a closed upvalue points at its own field, open ones point into the stack
+        obj_upvalue_t* upvalue = (obj_upvalue_t*)copy;
+        if (upvalue->location == &((obj_upvalue_t*)original)->closed)
+            upvalue->location = &upvalue->closed;
+    }
+    else if (copy->type == OBJ_STRING && STRING_IS_INLINE((obj_string_t*)original))
+    {
+        ((obj_string_t*)copy)->chars = ((obj_string_t*)copy)->data;
+    }
+}
+
+static void forward_fields(obj_t* obj, obj_t* (*forward)(obj_t* obj))
+{
+    switch (obj->type)
+    {
+    case OBJ_FUNCTION: {
+        obj_function_t* func = (obj_function_t*)obj;
+        func->name = (obj_string_t*)forward((obj_t*)func->name);
+        func->closure = (obj_closure_t*)forward((obj_t*)func->closure);
+        value_array_t* constants = &func->chunk.constants;
+        for (int i = 0; i < constants->count; i++)
+            constants->values[i] = forward_value(constants->values[i], forward);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        obj_closure_t* clos = (obj_closure_t*)obj;
+        clos->function = (obj_function_t*)forward((obj_t*)clos->function);
+        for (int i = 0; i < clos->upvalueCount; i++)
+            clos->upvalues[i] = (obj_upvalue_t*)forward((obj_t*)clos->upvalues[i]);
+        break;
+    }
+    case OBJ_UPVALUE: {
+        obj_upvalue_t* upvalue = (obj_upvalue_t*)obj;
+        upvalue->closed = forward_value(upvalue->closed, forward);
+        upvalue->next = (obj_upvalue_t*)forward((obj_t*)upvalue->next);
+        break;
+    }
+    case OBJ_ROPE: {
+        obj_rope_t* rope = (obj_rope_t*)obj;
+        rope->left = forward(rope->left);
+        rope->right = forward(rope->right);
+        rope->flat = (obj_string_t*)forward((obj_t*)rope->flat);
+        break;
+    }
+    case OBJ_STRING: {
+        obj_string_t* str = (obj_string_t*)obj;
+        if (!STRING_IS_INLINE(str) && str->parent != NULL)
+        {
+            // parents always hold their characters inline, the old parent is still readable
+            size_t offset = str->chars - str->parent->data;
+            str->parent = (obj_string_t*)forward((obj_t*)str->parent);
+            str->chars = str->parent->data + offset;
+        }
+        break;
+    }
+    case OBJ_NATIVE:
+        break;
+    }
+}
+
+static void forward_roots(obj_t* (*forward)(obj_t* obj))
+{
+    for (value_t* slot = vm.stack; slot < vm.stack_top; slot++)
+        *slot = forward_value(*slot, forward);
+
+    for (int i = 0; i < vm.frame_count; i++)
+        vm.frames[i].closure = (obj_closure_t*)forward((obj_t*)vm.frames[i].closure);
+
+    vm.openUpvalues = (obj_upvalue_t*)forward((obj_t*)vm.openUpvalues);
+
+    table_forward_references(&vm.global_names, forward);
+    for (int i = 0; i < vm.global_values.count; i++)
+        vm.global_values.values[i] = forward_value(vm.global_values.values[i], forward);
+    table_forward_references(&vm.strings, forward);
+}
+
+#ifdef GC_GENERATIONAL
+
+// a minor collection only moves objects out of the nursery
+static obj_t* forward_young(obj_t* obj)
+{
+    return obj != NULL && obj->in_nursery ? obj->next : obj;
+}
+
+// copies the survivors of a minor collection out of the nursery into the old heap, bigger
+// young objects are promoted where they are. only roots, remembered objects and other
+// survivors can point at a young object, so only those have to be forwarded
+static void evacuate_young(void)
+{
+    obj_t* obj = vm.nursery.young_objects;
+    vm.nursery.young_objects = NULL;
+    obj_t* promoted = NULL;
+
+    while (obj != NULL)
+    {
+        obj_t* next = obj->next;
+        if (!obj->is_marked)
+        {
+            free_object(obj);
+        }
+        else if (!obj->in_nursery)
+        {
+            obj->is_marked = false;
+            obj->is_old = true;
+            obj->next = promoted;
+            promoted = obj;
+        }
+        else
+        {
+            size_t size = object_size(obj);
+            // reallocate could start a collection
+            track_allocated(size);
+#ifdef USE_SYSTEM_ALLOCATOR
+            obj_t* copy = malloc(size);
+            if (copy == NULL)
+                exit(1);
+#else
+            obj_t* copy = pool_allocate(size);
+#endif
+            memcpy(copy, obj, size);
+            fix_interior(copy, obj);
+            copy->is_marked = false;
+            copy->is_old = true;
+            copy->in_nursery = false;
+            copy->next = promoted;
+            promoted = copy;
+
+            release_object(obj, size);
+            obj->next = copy;
+        }
+        obj = next;
+    }
+
+    for (int i = 0; i < vm.nursery.remembered_count; i++)
+        forward_fields(vm.nursery.remembered[i], forward_young);
+    forward_roots(forward_young);
+
+    while (promoted != NULL)
+    {
+        obj_t* next = promoted->next;
+        forward_fields(promoted, forward_young);
+        promoted->next = vm.objects;
+        vm.objects = promoted;
+        promoted = next;
+    }
+}
+
+#endif
+
+// copies every object into fresh contiguous pages and rewrites all references to them.
+// objects only move here, at a safe point of the interpreter where neither the compiler
+// nor any native code holds on to an object pointer.
+void compact_heap(void)
+{
+    uint64_t start = now_us();
+    vm.compact_pending = false;
+
+    int count = 0;
+    for (obj_t* obj = vm.objects; obj != NULL; obj = obj->next)
+        count++;
+#ifdef GC_GENERATIONAL
+    for (obj_t* obj = vm.nursery.young_objects; obj != NULL; obj = obj->next)
+        count++;
+#endif
+
+    obj_t** originals = malloc(sizeof(obj_t*) * (count > 0 ? count : 1));
+    if (originals == NULL)
+        return;
+
+    int index = 0;
+    for (obj_t* obj = vm.objects; obj != NULL; obj = obj->next)
+        originals[index++] = obj;
+#ifdef GC_GENERATIONAL
+    for (obj_t* obj = vm.nursery.young_objects; obj != NULL; obj = obj->next)
+        originals[index++] = obj;
+    vm.nursery.young_objects = NULL;
+    forget_remembered();
+#endif
+
+    heap_page_t* old_pages = vm.pages;
+    vm.pages = NULL;
+
+#ifndef USE_SYSTEM_ALLOCATOR
+    // the chunks the last sweep emptied go back before the copies are mapped
+    pool_trim(0);
+#endif
+
+    // copy in list order and leave a forwarding address behind
+    for (int i = 0; i < count; i++)
+    {
+        obj_t* original = originals[i];
+        size_t size = object_size(original);
+
+        if (vm.pages == NULL || vm.pages->used + PAGE_ALIGN(size) > vm.pages->size)
+            vm.pages = new_page(vm.pages, PAGE_ALIGN(size));
+
+        obj_t* copy = (obj_t*)((uint8_t*)vm.pages + vm.pages->used);
+        vm.pages->used += PAGE_ALIGN(size);
+        vm.pages->live++;
+        track_allocated(size);
+
+        memcpy(copy, original, size);
+        fix_interior(copy, original);
+        copy->in_page = true;
+#ifdef GC_GENERATIONAL
+        copy->in_nursery = false;
+        copy->is_old = true;
+        copy->is_remembered = false;
+#endif
+        original->next = copy;
+    }
+
+    for (int i = 0; i < count; i++)
+        forward_fields(originals[i]->next, forward_object);
+    forward_roots(forward_object);
+
+    // link the copies in address order, then release the originals
+    vm.objects = NULL;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        obj_t* copy = originals[i]->next;
+        copy->next = vm.objects;
+        vm.objects = copy;
+    }
+
+    for (int i = 0; i < count; i++)
+        release_object(originals[i], object_size(originals[i]));
+    free_pages(old_pages);
+    free(originals);
+    // returns the chunks of the originals, past what the heap grows back into
+    update_threshold();
+
+#ifdef GC_GENERATIONAL
+    reset_nursery();
+#endif
+
+    record_pause(now_us() - start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compacted %d objects\n", count);
+#endif
+}
+
+#endif
+
+static void free_object_list(obj_t* node)
 {
-    obj_t* node = vm.objects;
     while (node != NULL)
     {
         obj_t* next = node->next;
@@ -57,3 +1503,42 @@ void free_objects()
         node = next;
     }
 }
+
+void free_objects(void)
+{
+#ifndef GC_INCREMENTAL
+    stop_mark_pool();
+
+    // objects in pages are still walked below, the pages go last
+    heap_page_t* pages = vm.pages;
+    vm.pages = NULL;
+#endif
+
+    free_object_list(vm.objects);
+    vm.objects = NULL;
+
+#ifdef GC_GENERATIONAL
+    nursery_t* nursery = &vm.nursery;
+    free_object_list(nursery->young_objects);
+    nursery->young_objects = NULL;
+
+    delete_blocks(nursery->blocks);
+    delete_blocks(nursery->free_blocks);
+    nursery->blocks = NULL;
+    nursery->free_blocks = NULL;
+
+    free(nursery->remembered);
+    nursery->remembered = NULL;
+    nursery->remembered_count = 0;
+    nursery->remembered_capacity = 0;
+#endif
+
+    free(vm.gray_stack);
+    vm.gray_stack = NULL;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+
+#ifndef GC_INCREMENTAL
+    free_pages(pages);
+#endif
+}
@@ -3,6 +3,85 @@
 
 #include "object.h"
 
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_INITIAL_HEAP (1024 * 1024)
+// smaller heaps are not worth waking the marking threads for
+#define GC_PARALLEL_MIN_HEAP (4 * 1024 * 1024)
+#define GC_MAX_THREADS 64
+
+// compaction copies objects into pages of this size. pages are aligned to it, so the page
+// of an object is found by masking its address, bigger objects get a page of their own
+#define HEAP_PAGE_SIZE (256 * 1024)
+#define PAGE_OF(obj) ((heap_page_t*)((uintptr_t)(obj) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+
+typedef struct sheap_page_t {
+    struct sheap_page_t* next;
+    size_t used;
+    size_t size;
+    // objects in this page that have not been freed, the page is unmapped once none are left
+    int live;
+} heap_page_t;
+
+#ifdef GC_GENERATIONAL
+#define NURSERY_BLOCK_SIZE (64 * 1024)
+// a minor collection is due at the next safepoint once this many blocks are filled
+#define NURSERY_BLOCKS 4
+// objects bigger than this skip the nursery but are still treated as young
+#define NURSERY_MAX_OBJECT (NURSERY_BLOCK_SIZE / 8)
+
+typedef struct snursery_block_t {
+    struct snursery_block_t* next;
+    uint8_t* top;
+    uint8_t* end;
+} nursery_block_t;
+
+typedef struct {
+    // blocks filled since the last minor collection, the one allocated from comes first
+    nursery_block_t* blocks;
+    int block_count;
+    nursery_block_t* free_blocks;
+    // survivors are moved out, which can only happen at a safepoint. the nursery grows until then
+    bool minor_pending;
+    // mem_stats.total_allocated at the end of the last full collection
+    size_t allocated_at_full;
+
+    obj_t* young_objects;
+    // old objects that were written to since the last collection
+    int remembered_count;
+    int remembered_capacity;
+    obj_t** remembered;
+
+    bool collecting_minor;
+} nursery_t;
+#endif
+
+#ifdef GC_INCREMENTAL
+#define GC_DEFAULT_STEP_BUDGET_US 500
+// bytes allocated between two steps of a running cycle
+#define GC_STEP_SIZE (64 * 1024)
+// loops that do not allocate still advance a running cycle every this many iterations
+#define GC_BACKEDGE_INTERVAL 4096
+
+typedef enum {
+    GC_PHASE_IDLE,
+    GC_PHASE_MARK,
+    // dead strings are removed from the intern table
+    GC_PHASE_WEAK,
+    GC_PHASE_SWEEP
+} gc_phase_t;
+#endif
+
+// pauses below a millisecond are counted per microsecond, longer ones per millisecond
+#define GC_PAUSE_FINE_BUCKETS 1000
+#define GC_PAUSE_BUCKETS (GC_PAUSE_FINE_BUCKETS + 1000)
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint32_t histogram[GC_PAUSE_BUCKETS];
+} gc_pause_stats_t;
+
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
@@ -16,6 +95,98 @@
     reallocate(pointer, sizeof(type) * (old_count), 0)
 
 void* reallocate(void* previous, size_t old_size, size_t new_size);
-void free_objects();
+void* allocate_object_memory(size_t size);
+void mark_object(obj_t* obj);
+void mark_value(value_t value);
+void collect_garbage(void);
+void free_objects(void);
+// false if the object was not reached by the running collection
+bool is_object_live(obj_t* obj);
+
+#ifndef GC_INCREMENTAL
+void compact_heap(void);
+// objects only move at points where the interpreter holds no object pointers in C locals
+#ifdef GC_GENERATIONAL
+void collect_minor(void);
+#define gc_safepoint() \
+    do { \
+        if (vm.compact_pending) compact_heap(); \
+        else if (vm.nursery.minor_pending) collect_minor(); \
+    } while (false)
+#else
+#define gc_safepoint() \
+    do { if (vm.compact_pending) compact_heap(); } while (false)
+#endif
+#else
+#define gc_safepoint() ((void)0)
+#endif
+
+// who asked for memory, switched by the compiler and around native calls
+typedef enum {
+    ALLOC_SITE_RUNTIME,
+    ALLOC_SITE_COMPILER,
+    ALLOC_SITE_NATIVE,
+    ALLOC_SITE_COUNT
+} alloc_site_t;
+
+typedef struct {
+    size_t total_allocated;
+    size_t total_freed;
+    size_t peak;
+    uint64_t site_allocations[ALLOC_SITE_COUNT];
+    size_t site_bytes[ALLOC_SITE_COUNT];
+    int64_t live_objects[OBJ_TYPE_COUNT];
+    uint64_t total_objects[OBJ_TYPE_COUNT];
+} mem_stats_t;
+
+extern const char* ALLOC_SITE_NAMES[];
+extern const char* OBJ_TYPE_NAMES[];
+
+void count_object(obj_type_t type, int delta);
+void print_mem_stats(void);
+// memory the os keeps resident for the process, now and at most. zero where it does not tell
+void resident_bytes(size_t* now, size_t* peak);
+
+uint64_t gc_pause_percentile(double percentile);
+void print_gc_stats(void);
+
+#ifdef GC_GENERATIONAL
+void init_nursery(nursery_t* nursery);
+void remember_object(obj_t* obj);
+
+// has to be called after storing a reference into a heap object,
+// old objects pointing to young ones are roots of the next minor collection
+static inline void write_barrier(obj_t* owner)
+{
+    if (owner->is_old && !owner->is_remembered)
+        remember_object(owner);
+}
+
+#define write_barrier_value(value) ((void)0)
+#define gc_backedge() ((void)0)
+#elif defined(GC_INCREMENTAL)
+void gc_step(void);
+void regray_object(obj_t* obj);
+
+// has to be called after storing a reference into a heap object,
+// a black object that was written to is scanned again before marking ends
+static inline void write_barrier(obj_t* owner)
+{
+    if (owner->is_marked && !owner->is_gray)
+        regray_object(owner);
+}
+
+// for stores into roots that are only scanned at the start of a cycle (globals)
+#define write_barrier_value(value) \
+    do { if (vm.gc_phase == GC_PHASE_MARK) mark_value(value); } while (false)
+
+// called on loop back edges, these macros expand where vm is visible
+#define gc_backedge() \
+    do { if (vm.gc_phase != GC_PHASE_IDLE && ++vm.gc_backedges >= GC_BACKEDGE_INTERVAL) gc_step(); } while (false)
+#else
+#define write_barrier(owner) ((void)0)
+#define write_barrier_value(value) ((void)0)
+#define gc_backedge() ((void)0)
+#endif
 
 #endif
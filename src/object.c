@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -11,30 +12,65 @@
 
 static obj_t* allocate_object(size_t size, obj_type_t type)
 {
-    obj_t* obj = (obj_t*)reallocate(NULL, 0, size);
+    obj_t* obj = (obj_t*)allocate_object_memory(size);
     obj->type = type;
+    count_object(type, 1);
+    obj->is_marked = false;
+    obj->in_page = false;
 
+#ifdef GC_INCREMENTAL
+    // new objects are white while marking, they are found through the roots or a barrier.
+    // once marking is done they have to survive the upcoming sweep.
+    obj->is_gray = false;
+    obj->is_marked = vm.gc_phase == GC_PHASE_WEAK;
+    // the sweep cursor sits on the old head of the list, keep the link to it intact
+    if (vm.gc_phase == GC_PHASE_SWEEP && vm.sweep_previous == NULL)
+        vm.sweep_previous = obj;
+#endif
+
+#ifdef GC_GENERATIONAL
+    obj->is_old = false;
+    obj->is_remembered = false;
+    obj->in_nursery = size <= NURSERY_MAX_OBJECT;
+
+    obj->next = vm.nursery.young_objects;
+    vm.nursery.young_objects = obj;
+#else
     obj->next = vm.objects;
     vm.objects = obj;
+#endif
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*)obj, size, type);
+#endif
 
     return obj;
 }
 
 
-static obj_string_t* allocate_string(char* chars, int length, uint32_t hash)
+obj_string_t* new_string(int length)
 {
-    obj_string_t* str = ALLOCATE_OBJ(obj_string_t, OBJ_STRING);
-    str->chars = chars;
+    obj_string_t* str = (obj_string_t*)allocate_object(STRING_SIZE(length), OBJ_STRING);
     str->length = length;
-    str->hash = hash;
+    str->is_interned = false;
+    str->hash = 0;
+    str->chars = str->data;
+    str->parent = NULL;
+    str->chars[length] = '\0';
+    return str;
+}
 
-    table_set(&vm.strings, str, NIL_VAL);
+static void add_interned(obj_string_t* str)
+{
+    str->is_interned = true;
 
-    return str;
+    // keep the new string reachable in case growing the table triggers a collection
+    push(OBJ_VAL(str));
+    table_set(&vm.strings, str, NIL_VAL);
+    pop();
 }
 
-// FNV-1a
-static uint32_t hash_string(const char* key, int length)
+uint32_t hash_fnv1a(const char* key, int length)
 {
     uint32_t hash = 2166136261u;
 
@@ -47,6 +83,92 @@ static uint32_t hash_string(const char* key, int length)
     return hash;
 }
 
+#define HASH_MULTIPLIER_A 0x9E3779B97F4A7C15ull
+#define HASH_MULTIPLIER_B 0xBF58476D1CE4E5B9ull
+
+// memcpy compiles to a single unaligned load
+static inline uint64_t read_word(const char* chars)
+{
+    uint64_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+
+static inline uint64_t read_half(const char* chars)
+{
+    uint32_t half;
+    memcpy(&half, chars, sizeof(half));
+    return half;
+}
+
+static inline uint64_t mix_word(uint64_t hash, uint64_t word, uint64_t multiplier)
+{
+    hash = (hash ^ word) * multiplier;
+    return hash ^ (hash >> 29);
+}
+
+uint32_t hash_words(const char* key, int length)
+{
+    const char* end = key + length;
+    uint64_t hash = HASH_MULTIPLIER_A ^ (uint64_t)length;
+
+    if (length >= 16)
+    {
+        // a second lane keeps two multiplications in flight on long strings
+        uint64_t other = HASH_MULTIPLIER_B;
+        do
+        {
+            hash = mix_word(hash, read_word(key), HASH_MULTIPLIER_B);
+            other = mix_word(other, read_word(key + 8), HASH_MULTIPLIER_A);
+            key += 16;
+        } while (end - key >= 16);
+        hash = mix_word(hash, other, HASH_MULTIPLIER_B);
+    }
+    if (end - key > 8)
+    {
+        hash = mix_word(hash, read_word(key), HASH_MULTIPLIER_B);
+        key += 8;
+    }
+
+    // the last bytes are read with loads that may overlap each other or hashed bytes,
+    // the length in the seed tells the cases apart
+    uint64_t tail = 0;
+    if (length >= 8)
+        tail = read_word(end - 8);
+    else if (length >= 4)
+        tail = (read_half(key) << 32) | read_half(end - 4);
+    else if (length > 0)
+        tail = ((uint64_t)(uint8_t)key[0] << 16) | ((uint64_t)(uint8_t)key[length / 2] << 8) | (uint8_t)end[-1];
+
+    // the table takes the fragment from the low bits and the group from the high ones,
+    // so every input bit has to reach all of them
+    hash = mix_word(hash, tail, HASH_MULTIPLIER_B);
+    hash *= HASH_MULTIPLIER_A;
+    return (uint32_t)(hash >> 32);
+}
+
+uint32_t hash_string(const char* key, int length)
+{
+#ifdef HASH_FNV1A
+    return hash_fnv1a(key, length);
+#else
+    return hash_words(key, length);
+#endif
+}
+
+static obj_string_t* find_interned(const char* chars, int length, uint32_t hash)
+{
+    obj_string_t* interned = table_find_string(&vm.strings, chars, length, hash);
+
+#ifdef GC_INCREMENTAL
+    // the string may be dead but not yet removed from the intern table, bring it back
+    if (interned != NULL && vm.gc_phase == GC_PHASE_WEAK)
+        interned->obj.is_marked = true;
+#endif
+
+    return interned;
+}
+
 obj_function_t* new_function(void)
 {
     obj_function_t* func = ALLOCATE_OBJ(obj_function_t, OBJ_FUNCTION);
@@ -54,20 +176,28 @@ obj_function_t* new_function(void)
     func->arity = 0;
     func->upvalueCount = 0;
     func->name = NULL;
+    func->closure = NULL;
     init_chunk(&(func->chunk));
     return func;
 }
 
 obj_closure_t* new_closure(obj_function_t* function)
 {
-    obj_upvalue_t** upvalues = ALLOCATE(obj_upvalue_t*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++)
-        upvalues[i] = NULL;
+    if (function->closure != NULL)
+        return function->closure;
 
-    obj_closure_t* clos = ALLOCATE_OBJ(obj_closure_t, OBJ_CLOSURE);
+    obj_closure_t* clos = (obj_closure_t*)allocate_object(CLOSURE_SIZE(function->upvalueCount), OBJ_CLOSURE);
     clos->function = function;
-    clos->upvalues = upvalues;
     clos->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++)
+        clos->upvalues[i] = NULL;
+
+    // nothing can differ between closures that capture nothing, so keep the first one around
+    if (function->upvalueCount == 0)
+    {
+        function->closure = clos;
+        write_barrier((obj_t*)function);
+    }
     return clos;
 }
 
@@ -78,34 +208,58 @@ obj_native_t* new_native(native_func_t func)
     return nat;
 }
 
-obj_string_t* take_string(char* chars, int length)
+obj_string_t* copy_string(const char* chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
-    obj_string_t* interned = table_find_string(&vm.strings, chars, length, hash);
+    obj_string_t* interned = find_interned(chars, length, hash);
 
     if (interned != NULL)
-    {
-        FREE_ARRAY(char, chars, length + 1);
         return interned;
-    }
 
-    return allocate_string(chars, length, hash);
+    obj_string_t* str = new_string(length);
+    memcpy(str->chars, chars, length);
+    str->hash = hash;
+
+    add_interned(str);
+    return str;
 }
 
-obj_string_t* copy_string(const char* chars, int length)
+obj_string_t* borrow_string(const char* chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
-    obj_string_t* interned = table_find_string(&vm.strings, chars, length, hash);
+    obj_string_t* interned = find_interned(chars, length, hash);
 
     if (interned != NULL)
         return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
+    obj_string_t* str = (obj_string_t*)allocate_object(sizeof(obj_string_t), OBJ_STRING);
+    str->length = length;
+    str->is_interned = false;
+    str->hash = hash;
+    str->chars = (char*)chars;
+    str->parent = NULL;
 
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    add_interned(str);
+    return str;
+}
 
-    return allocate_string(heapChars, length, hash);
+obj_string_t* slice_string(obj_string_t* str, int start, int length)
+{
+    if (start == 0 && length == str->length)
+        return str;
+
+    // always slice the string that owns the characters, borrowed ones need no owner at all
+    obj_string_t* parent = str->parent;
+    if (parent == NULL && STRING_IS_INLINE(str))
+        parent = str;
+
+    obj_string_t* slice = (obj_string_t*)allocate_object(sizeof(obj_string_t), OBJ_STRING);
+    slice->length = length;
+    slice->is_interned = false;
+    slice->hash = 0;
+    slice->chars = str->chars + start;
+    slice->parent = parent;
+    return slice;
 }
 
 obj_upvalue_t* new_upvalue(value_t* slot)
@@ -117,18 +271,97 @@ obj_upvalue_t* new_upvalue(value_t* slot)
     return upvalue;
 }
 
+static int text_length(obj_t* text)
+{
+    return text->type == OBJ_STRING ? ((obj_string_t*)text)->length : ((obj_rope_t*)text)->length;
+}
+
+static int text_depth(obj_t* text)
+{
+    return text->type == OBJ_STRING ? 0 : ((obj_rope_t*)text)->depth;
+}
+
+// a flattened rope is as good as its string
+static obj_t* skip_flattened(obj_t* text)
+{
+    if (text->type == OBJ_ROPE && ((obj_rope_t*)text)->flat != NULL)
+        return (obj_t*)((obj_rope_t*)text)->flat;
+    return text;
+}
+
+static void copy_text(obj_t* text, char* dest)
+{
+    text = skip_flattened(text);
+    while (text->type == OBJ_ROPE)
+    {
+        // appending in a loop builds left leaning ropes, so only the right side recurses
+        obj_rope_t* rope = (obj_rope_t*)text;
+        copy_text(rope->right, dest + text_length(rope->left));
+        text = skip_flattened(rope->left);
+    }
+
+    obj_string_t* str = (obj_string_t*)text;
+    memcpy(dest, str->chars, str->length);
+}
+
+obj_rope_t* new_rope(obj_t* left, obj_t* right)
+{
+    left = skip_flattened(left);
+    right = skip_flattened(right);
+
+    obj_rope_t* rope = ALLOCATE_OBJ(obj_rope_t, OBJ_ROPE);
+    rope->length = text_length(left) + text_length(right);
+    rope->depth = text_depth(left);
+    if (text_depth(right) + 1 > rope->depth)
+        rope->depth = text_depth(right) + 1;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+
+    if (rope->depth > ROPE_MAX_DEPTH)
+    {
+        push(OBJ_VAL(rope));
+        flatten_rope(rope);
+        pop();
+    }
+    return rope;
+}
+
+obj_string_t* flatten_rope(obj_rope_t* rope)
+{
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    push(OBJ_VAL(rope));
+    obj_string_t* str = new_string(rope->length);
+    copy_text((obj_t*)rope, str->chars);
+    pop();
+
+    rope->flat = str;
+    rope->left = NULL;
+    rope->right = NULL;
+    write_barrier((obj_t*)rope);
+    return str;
+}
+
 void print_object(value_t value)
 {
     switch (OBJ_TYPE(value))
     {
     case OBJ_FUNCTION: {
         obj_function_t* func = AS_FUNCTION(value);
-        printf("<fn %s>", func->name != NULL ? func->name->chars : "SCRIPT");
+        if (func->name != NULL)
+            printf("<fn %.*s>", func->name->length, func->name->chars);
+        else
+            printf("<fn SCRIPT>");
         break;
     }
     case OBJ_CLOSURE: {
         obj_closure_t* clos = AS_CLOSURE(value);
-        printf("<fn %s>", clos->function->name != NULL ? clos->function->name->chars : "SCRIPT");
+        if (clos->function->name != NULL)
+            printf("<fn %.*s>", clos->function->name->length, clos->function->name->chars);
+        else
+            printf("<fn SCRIPT>");
         break;
     }
     case OBJ_NATIVE: {
@@ -136,10 +369,26 @@ void print_object(value_t value)
         break;
     }
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
         break;
     case OBJ_UPVALUE:
         printf("upvalue");
         break;
+    case OBJ_ROPE: {
+        obj_rope_t* rope = AS_ROPE(value);
+        if (rope->flat != NULL)
+        {
+            printf("%.*s", rope->flat->length, rope->flat->chars);
+            break;
+        }
+        // copied outside of the heap, printing must not trigger a collection
+        char* chars = malloc(rope->length);
+        if (chars == NULL)
+            exit(1);
+        copy_text((obj_t*)rope, chars);
+        fwrite(chars, 1, rope->length, stdout);
+        free(chars);
+        break;
+    }
     }
 }
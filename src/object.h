@@ -1,6 +1,8 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <string.h>
+
 #include "common.h"
 #include "chunk.h"
 #include "value.h"
@@ -11,32 +13,54 @@
 #define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
+#define IS_ROPE(value) is_obj_type(value, OBJ_ROPE)
+// anything that can be concatenated
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_FUNCTION(value) ((obj_function_t*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((obj_closure_t*)AS_OBJ(value))
 #define AS_NATIVE(value) (((obj_native_t*)AS_OBJ(value))->function)
 #define AS_STRING(value) ((obj_string_t*)AS_OBJ(value))
 #define AS_CSTRING(value) (((obj_string_t*)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((obj_rope_t*)AS_OBJ(value))
 
 typedef enum {
     OBJ_FUNCTION,
     OBJ_CLOSURE,
     OBJ_NATIVE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_ROPE
 } obj_type_t;
 
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
 struct sobj_t {
     obj_type_t type;
+    bool is_marked;
+    // moved into a compacted page, its memory is released with the page
+    bool in_page;
+#ifdef GC_GENERATIONAL
+    bool is_old;
+    bool is_remembered;
+    bool in_nursery;
+#endif
+#ifdef GC_INCREMENTAL
+    bool is_gray;
+#endif
     struct sobj_t* next;
 };
 
+typedef struct sobj_closure_t obj_closure_t;
+
 typedef struct {
     obj_t obj;
     int arity;
     int upvalueCount;
     chunk_t chunk;
     obj_string_t* name;
+    // functions without upvalues all share one closure
+    obj_closure_t* closure;
 } obj_function_t;
 
 typedef value_t(*native_func_t)(int argCount, value_t* args);
@@ -49,10 +73,38 @@ typedef struct {
 struct sobj_string_t {
     obj_t obj;
     int length;
-    char* chars;
+    // strings made at runtime are only hashed and interned when they become a table key
+    bool is_interned;
     uint32_t hash;
+    // points at data, or into a retained source buffer for borrowed strings which are
+    // neither null terminated nor ever written to
+    char* chars;
+    // slices point into the data of this string and keep it alive
+    struct sobj_string_t* parent;
+    char data[];
 };
 
+#define STRING_SIZE(length) (sizeof(obj_string_t) + (length) + 1)
+#define STRING_IS_INLINE(str) ((str)->chars == (str)->data)
+#define STRING_OBJECT_SIZE(str) (STRING_IS_INLINE(str) ? STRING_SIZE((str)->length) : sizeof(obj_string_t))
+
+// shorter concatenations are copied right away
+#define ROPE_MIN_LENGTH 32
+// deeper ropes are flattened when they are made, copying a rope recurses this deep at most
+#define ROPE_MAX_DEPTH 256
+
+// the result of a concatenation, copied into a flat string once its contents are needed
+typedef struct {
+    obj_t obj;
+    int length;
+    // copying loops down the left halves and only recurses into the right ones
+    int depth;
+    // strings or ropes, both dropped once the rope was flattened
+    obj_t* left;
+    obj_t* right;
+    obj_string_t* flat;
+} obj_rope_t;
+
 typedef struct sobj_upvalue_t {
     obj_t obj;
     value_t* location;
@@ -60,19 +112,36 @@ typedef struct sobj_upvalue_t {
     struct sobj_upvalue_t* next;
 } obj_upvalue_t;
 
-typedef struct {
+struct sobj_closure_t {
     obj_t obj;
     obj_function_t* function;
-    obj_upvalue_t** upvalues;
     int upvalueCount;
-} obj_closure_t;
+    obj_upvalue_t* upvalues[];
+};
+
+#define CLOSURE_SIZE(upvalueCount) (sizeof(obj_closure_t) + sizeof(obj_upvalue_t*) * (upvalueCount))
 
 obj_function_t* new_function(void);
 obj_closure_t* new_closure(obj_function_t* function);
 obj_native_t* new_native(native_func_t func);
-obj_string_t* take_string(char* chars, int length);
+// allocates a string with room for length chars, it is not interned
+obj_string_t* new_string(int length);
+// table keys have to be interned, strings made at runtime never become keys
 obj_string_t* copy_string(const char* chars, int length);
+// the hash strings are interned by, selected with HASH_FNV1A in common.h
+uint32_t hash_string(const char* key, int length);
+// byte at a time
+uint32_t hash_fnv1a(const char* key, int length);
+// eight bytes at a time
+uint32_t hash_words(const char* key, int length);
+// like copy_string, but chars have to outlive the string, e.g. source code retained by the vm
+obj_string_t* borrow_string(const char* chars, int length);
+// shares the characters of str instead of copying them
+obj_string_t* slice_string(obj_string_t* str, int start, int length);
 obj_upvalue_t* new_upvalue(value_t* slot);
+// left and right are strings or ropes
+obj_rope_t* new_rope(obj_t* left, obj_t* right);
+obj_string_t* flatten_rope(obj_rope_t* rope);
 
 void print_object(value_t value);
 
@@ -81,4 +150,14 @@ static inline bool is_obj_type(value_t value, obj_type_t type)
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+// interned strings are equal only if they are the same object, all others compare their contents
+static inline bool strings_equal(obj_string_t* a, obj_string_t* b)
+{
+    if (a == b)
+        return true;
+    if (a->is_interned && b->is_interned)
+        return false;
+    return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
 #endif
@@ -0,0 +1,197 @@
+#include <string.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+#define NO_TARGET -1
+
+static bool is_jump(uint8_t instruction)
+{
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+        instruction == OP_JUMP_IF_TRUE || instruction == OP_LOOP;
+}
+
+static bool is_terminator(uint8_t instruction)
+{
+    return instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN;
+}
+
+static int read_jump(chunk_t* chunk, int offset)
+{
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// fills in the destination of every jump, indexed by the offset of the jump
+static void find_targets(chunk_t* chunk, int* targets, bool* is_target)
+{
+    memset(is_target, 0, sizeof(bool) * chunk->count);
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset))
+    {
+        targets[offset] = NO_TARGET;
+        if (is_jump(chunk->code[offset]))
+        {
+            targets[offset] = read_jump(chunk, offset);
+            is_target[targets[offset]] = true;
+        }
+    }
+}
+
+// a jump to an unconditional jump goes straight to its destination. a conditional jump can also
+// follow one of its own kind, the tested value is still the same when the second one runs.
+static void thread_jumps(chunk_t* chunk, int* targets)
+{
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset))
+    {
+        uint8_t instruction = chunk->code[offset];
+        if (!is_jump(instruction) || instruction == OP_LOOP)
+            continue;
+
+        int target = targets[offset];
+        // a chain that jumps around in a circle never settles, so the walk is bounded
+        for (int steps = 0; steps < chunk->count; steps++)
+        {
+            uint8_t next = chunk->code[target];
+            bool follow = next == OP_JUMP || next == instruction ||
+                (next == OP_LOOP && instruction == OP_JUMP);
+            if (!follow)
+                break;
+            target = targets[target];
+        }
+
+        // only an unconditional jump can turn into a loop, which also keeps the collector poll
+        bool backward = target < offset + 3;
+        if (backward && instruction != OP_JUMP)
+            continue;
+        int jump = backward ? offset + 3 - target : target - offset - 3;
+        if (jump > UINT16_MAX)
+            continue;
+
+        if (backward)
+            chunk->code[offset] = OP_LOOP;
+        chunk->code[offset + 1] = (jump >> 8) & 0xFF;
+        chunk->code[offset + 2] = jump & 0xFF;
+        targets[offset] = target;
+    }
+}
+
+static void remove_dead_code(chunk_t* chunk, bool* is_target, bool* removed)
+{
+    bool dead = false;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int length = instruction_length(chunk, offset);
+        if (is_target[offset])
+            dead = false;
+        if (dead)
+            memset(removed + offset, true, length);
+        else if (is_terminator(chunk->code[offset]))
+            dead = true;
+        offset += length;
+    }
+}
+
+// statements pop their condition on both paths, so a negated condition can be tested the other
+// way round instead
+static void fold_negated_conditions(chunk_t* chunk, int* targets, bool* is_target, bool* removed)
+{
+    for (int offset = 0; offset + 4 < chunk->count; offset += instruction_length(chunk, offset))
+    {
+        int jump = offset + 1;
+        if (chunk->code[offset] != OP_NOT || removed[offset] ||
+            chunk->code[jump] != OP_JUMP_IF_FALSE || is_target[offset] || is_target[jump])
+            continue;
+        if (chunk->code[jump + 3] != OP_POP || chunk->code[targets[jump]] != OP_POP)
+            continue;
+
+        removed[offset] = true;
+        chunk->code[jump] = OP_JUMP_IF_TRUE;
+    }
+}
+
+// a scope that ends pops each of its locals on its own
+static void merge_pops(chunk_t* chunk, bool* is_target, bool* removed)
+{
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int count = 0;
+        while (offset + count < chunk->count && count < UINT8_MAX &&
+            chunk->code[offset + count] == OP_POP && !removed[offset + count] &&
+            (count == 0 || !is_target[offset + count]))
+        {
+            count++;
+        }
+
+        if (count >= 2)
+        {
+            chunk->code[offset] = OP_POPN;
+            chunk->code[offset + 1] = (uint8_t)count;
+            memset(removed + offset + 2, true, count - 2);
+            offset += count;
+        }
+        else
+        {
+            offset += instruction_length(chunk, offset);
+        }
+    }
+}
+
+static void compact(chunk_t* chunk, int* targets, bool* removed)
+{
+    // new offset of every old offset, one past the end included for jumps to the end
+    int* moved = ALLOCATE(int, chunk->count + 1);
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset++)
+    {
+        moved[offset] = count;
+        if (!removed[offset])
+            count++;
+    }
+    moved[chunk->count] = count;
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset))
+    {
+        if (removed[offset] || !is_jump(chunk->code[offset]))
+            continue;
+
+        int end = moved[offset] + 3;
+        int target = moved[targets[offset]];
+        int jump = chunk->code[offset] == OP_LOOP ? end - target : target - end;
+        chunk->code[offset + 1] = (jump >> 8) & 0xFF;
+        chunk->code[offset + 2] = jump & 0xFF;
+    }
+
+    for (int offset = 0; offset < chunk->count; offset++)
+    {
+        if (removed[offset])
+            continue;
+        chunk->code[moved[offset]] = chunk->code[offset];
+        chunk->lines[moved[offset]] = chunk->lines[offset];
+    }
+
+    FREE_ARRAY(int, moved, chunk->count + 1);
+    chunk->count = count;
+}
+
+void optimize_chunk(chunk_t* chunk)
+{
+    int count = chunk->count;
+    int* targets = ALLOCATE(int, count);
+    bool* is_target = ALLOCATE(bool, count);
+    bool* removed = ALLOCATE(bool, count);
+    memset(removed, 0, sizeof(bool) * count);
+
+    find_targets(chunk, targets, is_target);
+    thread_jumps(chunk, targets);
+    // threading may leave instructions nothing jumps to anymore
+    find_targets(chunk, targets, is_target);
+
+    remove_dead_code(chunk, is_target, removed);
+    fold_negated_conditions(chunk, targets, is_target, removed);
+    merge_pops(chunk, is_target, removed);
+    compact(chunk, targets, removed);
+
+    FREE_ARRAY(int, targets, count);
+    FREE_ARRAY(bool, is_target, count);
+    FREE_ARRAY(bool, removed, count);
+}
@@ -0,0 +1,10 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+// rewrites redundant instruction sequences left by the single pass compiler, jumps are
+// repatched and the line of every remaining byte is kept
+void optimize_chunk(chunk_t* chunk);
+
+#endif
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "pool.h"
+
+#define CLASS_OF(size) (((size) - 1) / POOL_GRANULARITY)
+#define CLASS_SIZE(index) (((index) + 1) * POOL_GRANULARITY)
+
+typedef struct spool_block_t {
+    struct spool_block_t* next;
+} pool_block_t;
+
+typedef struct spool_chunk_t {
+    struct spool_chunk_t* next;
+    struct spool_chunk_t* prev;
+    size_t size;
+    // slabs are cut from the front, the rest of the chunk has not been touched yet
+    uint8_t* slab_top;
+    uint8_t* slab_end;
+    // slabs that belong to a class, pool_trim gives the chunk back once none are left
+    int used_slabs;
+} pool_chunk_t;
+
+// slabs are aligned to their size, so the slab of a block is found by masking its address
+typedef struct spool_slab_t {
+    struct spool_slab_t* next;
+    struct spool_slab_t* prev;
+    pool_chunk_t* chunk;
+    // blocks freed in this slab, taken before the untouched rest at top
+    pool_block_t* free_list;
+    uint8_t* top;
+    int live;
+    int class_index;
+} pool_slab_t;
+
+#define SLAB_DATA_OFFSET ((sizeof(pool_slab_t) + POOL_GRANULARITY - 1) & ~(size_t)(POOL_GRANULARITY - 1))
+#define SLAB_OF(pointer) ((pool_slab_t*)((uintptr_t)(pointer) & ~(uintptr_t)(POOL_SLAB_SIZE - 1)))
+
+typedef struct {
+    // slabs of this class with room for at least one more block
+    pool_slab_t* slabs;
+} pool_class_t;
+
+typedef struct {
+    pool_class_t classes[POOL_CLASS_COUNT];
+    // the first chunk is the one slabs are cut from
+    pool_chunk_t* chunks;
+    // slabs that were emptied, they can go to any class
+    pool_slab_t* free_slabs;
+    size_t mapped_bytes;
+    size_t peak_mapped_bytes;
+    bool huge_pages;
+} pool_t;
+
+static pool_t pool;
+
+void init_pool(void)
+{
+    memset(&pool, 0, sizeof(pool_t));
+}
+
+void pool_unmap(void* memory, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, size);
+#endif
+}
+
+static void unmap_chunk(pool_chunk_t* chunk)
+{
+    pool_unmap(chunk, chunk->size);
+}
+
+void free_pool(void)
+{
+    pool_chunk_t* chunk = pool.chunks;
+    while (chunk != NULL)
+    {
+        pool_chunk_t* next = chunk->next;
+        unmap_chunk(chunk);
+        chunk = next;
+    }
+    init_pool();
+}
+
+void pool_use_huge_pages(bool enable)
+{
+    pool.huge_pages = enable;
+}
+
+size_t pool_mapped_bytes(void)
+{
+    return pool.mapped_bytes;
+}
+
+size_t pool_peak_mapped_bytes(void)
+{
+    return pool.peak_mapped_bytes;
+}
+
+// chunks are mapped straight from the os, so an empty one can be handed back
+static void* map_chunk(size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+#endif
+}
+
+void* pool_map_aligned(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+    // find an aligned address in a reservation, then map exactly there.
+    // another thread can take the range in between, so try until it sticks
+    for (;;)
+    {
+        void* probe = VirtualAlloc(NULL, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+        if (probe == NULL)
+            return NULL;
+        uintptr_t aligned = ((uintptr_t)probe + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        VirtualFree(probe, 0, MEM_RELEASE);
+
+        void* memory = VirtualAlloc((void*)aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (memory != NULL)
+            return memory;
+    }
+#else
+    // map more than asked for and cut off what lies outside the aligned range
+    uint8_t* memory = map_chunk(size + alignment);
+    if (memory == NULL)
+        return NULL;
+
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)memory + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (aligned > memory)
+        munmap(memory, aligned - memory);
+    munmap(aligned + size, memory + alignment - aligned);
+    return aligned;
+#endif
+}
+
+// falls back to regular pages when no huge pages are available
+static void* map_huge_chunk(size_t size)
+{
+    void* memory = NULL;
+#ifdef _WIN32
+    // needs the "lock pages in memory" privilege
+    SIZE_T large = GetLargePageMinimum();
+    if (large != 0 && size % large == 0)
+        memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory == MAP_FAILED)
+        memory = NULL;
+#endif
+    if (memory == NULL)
+    {
+        // transparent huge pages, if the kernel has them enabled. they only back
+        // ranges that start on a huge page boundary
+        memory = pool_map_aligned(size, POOL_HUGE_CHUNK_SIZE);
+#ifdef MADV_HUGEPAGE
+        if (memory != NULL)
+            madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    }
+#endif
+    if (memory == NULL)
+        memory = map_chunk(size);
+    return memory;
+}
+
+static void link_slab(pool_slab_t** list, pool_slab_t* slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void unlink_slab(pool_slab_t** list, pool_slab_t* slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+// the header takes the front of the chunk, slabs start at the next aligned address
+static uint8_t* first_slab(pool_chunk_t* chunk)
+{
+    return (uint8_t*)(((uintptr_t)chunk + sizeof(pool_chunk_t) + POOL_SLAB_SIZE - 1) & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+}
+
+static pool_chunk_t* new_chunk(void)
+{
+    size_t size = pool.huge_pages ? POOL_HUGE_CHUNK_SIZE : POOL_CHUNK_SIZE;
+    pool_chunk_t* chunk = pool.huge_pages ? map_huge_chunk(size) : map_chunk(size);
+    if (chunk == NULL)
+        exit(1);
+
+    chunk->size = size;
+    chunk->slab_top = first_slab(chunk);
+    chunk->slab_end = (uint8_t*)(((uintptr_t)chunk + size) & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+    chunk->used_slabs = 0;
+
+    chunk->prev = NULL;
+    chunk->next = pool.chunks;
+    if (pool.chunks != NULL)
+        pool.chunks->prev = chunk;
+    pool.chunks = chunk;
+
+    pool.mapped_bytes += size;
+    if (pool.mapped_bytes > pool.peak_mapped_bytes)
+        pool.peak_mapped_bytes = pool.mapped_bytes;
+    return chunk;
+}
+
+static void release_chunk(pool_chunk_t* chunk)
+{
+    // every slab cut from the chunk is empty and waits on the free list
+    for (uint8_t* slab = first_slab(chunk); slab < chunk->slab_top; slab += POOL_SLAB_SIZE)
+        unlink_slab(&pool.free_slabs, (pool_slab_t*)slab);
+
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        pool.chunks = chunk->next;
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+
+    pool.mapped_bytes -= chunk->size;
+    unmap_chunk(chunk);
+}
+
+static pool_slab_t* new_slab(int index)
+{
+    pool_slab_t* slab = pool.free_slabs;
+    if (slab != NULL)
+    {
+        unlink_slab(&pool.free_slabs, slab);
+    }
+    else
+    {
+        pool_chunk_t* chunk = pool.chunks;
+        if (chunk == NULL || chunk->slab_top + POOL_SLAB_SIZE > chunk->slab_end)
+            chunk = new_chunk();
+
+        slab = (pool_slab_t*)chunk->slab_top;
+        slab->chunk = chunk;
+        chunk->slab_top += POOL_SLAB_SIZE;
+    }
+
+    slab->chunk->used_slabs++;
+
+    slab->free_list = NULL;
+    slab->top = (uint8_t*)slab + SLAB_DATA_OFFSET;
+    slab->live = 0;
+    slab->class_index = index;
+    link_slab(&pool.classes[index].slabs, slab);
+    return slab;
+}
+
+static void free_slab(pool_slab_t* slab)
+{
+    link_slab(&pool.free_slabs, slab);
+    slab->chunk->used_slabs--;
+}
+
+void pool_trim(size_t keep)
+{
+    size_t kept = 0;
+    pool_chunk_t* chunk = pool.chunks;
+    while (chunk != NULL)
+    {
+        pool_chunk_t* next = chunk->next;
+        if (chunk->used_slabs == 0)
+        {
+            if (kept + chunk->size <= keep)
+                kept += chunk->size;
+            else
+                release_chunk(chunk);
+        }
+        chunk = next;
+    }
+}
+
+static bool slab_full(pool_slab_t* slab, size_t class_size)
+{
+    return slab->free_list == NULL && slab->top + class_size > (uint8_t*)slab + POOL_SLAB_SIZE;
+}
+
+void* pool_allocate(size_t size)
+{
+    if (size == 0)
+        return NULL;
+    if (size > POOL_MAX_SIZE)
+        return malloc(size);
+
+    int index = CLASS_OF(size);
+    size_t class_size = CLASS_SIZE(index);
+    pool_class_t* cls = pool.classes + index;
+
+    pool_slab_t* slab = cls->slabs;
+    if (slab == NULL)
+        slab = new_slab(index);
+
+    void* result;
+    if (slab->free_list != NULL)
+    {
+        result = slab->free_list;
+        slab->free_list = slab->free_list->next;
+    }
+    else
+    {
+        result = slab->top;
+        slab->top += class_size;
+    }
+
+    slab->live++;
+    if (slab_full(slab, class_size))
+        unlink_slab(&cls->slabs, slab);
+    return result;
+}
+
+void pool_free(void* pointer, size_t size)
+{
+    if (pointer == NULL)
+        return;
+    if (size > POOL_MAX_SIZE)
+    {
+        free(pointer);
+        return;
+    }
+
+    pool_slab_t* slab = SLAB_OF(pointer);
+    pool_class_t* cls = pool.classes + slab->class_index;
+    bool was_full = slab_full(slab, CLASS_SIZE(slab->class_index));
+
+    pool_block_t* block = (pool_block_t*)pointer;
+    block->next = slab->free_list;
+    slab->free_list = block;
+
+    if (--slab->live == 0)
+    {
+        if (!was_full)
+            unlink_slab(&cls->slabs, slab);
+        free_slab(slab);
+    }
+    else if (was_full)
+    {
+        link_slab(&cls->slabs, slab);
+    }
+}
+
+void* pool_reallocate(void* previous, size_t old_size, size_t new_size)
+{
+    if (previous == NULL)
+        return pool_allocate(new_size);
+
+    if (new_size == 0)
+    {
+        pool_free(previous, old_size);
+        return NULL;
+    }
+
+    if (old_size > POOL_MAX_SIZE && new_size > POOL_MAX_SIZE)
+        return realloc(previous, new_size);
+
+    // still fits the block it already has
+    if (old_size <= POOL_MAX_SIZE && new_size <= POOL_MAX_SIZE && CLASS_OF(old_size) == CLASS_OF(new_size))
+        return previous;
+
+    void* result = pool_allocate(new_size);
+    if (result == NULL)
+        return NULL;
+    memcpy(result, previous, old_size < new_size ? old_size : new_size);
+    pool_free(previous, old_size);
+    return result;
+}
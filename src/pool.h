@@ -0,0 +1,38 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common.h"
+
+// size-class allocator for objects and small arrays, everything larger goes to libc.
+// blocks of a class are handed out from slabs and recycled through a free list per slab.
+// a slab whose blocks all died can take another class, a chunk whose slabs all died can go
+// back to the os.
+
+#define POOL_GRANULARITY 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+// slabs are carved out of chunks, which are the unit requested from the os
+#define POOL_SLAB_SIZE (16 * 1024)
+#define POOL_CHUNK_SIZE (1024 * 1024)
+#define POOL_HUGE_CHUNK_SIZE (2 * 1024 * 1024)
+
+void init_pool(void);
+void free_pool(void);
+// back chunks allocated from now on with huge pages where the os allows it
+void pool_use_huge_pages(bool enable);
+// unmaps chunks without a single live block, except for keep bytes of them
+void pool_trim(size_t keep);
+// bytes of chunks mapped from the os, now and at most
+size_t pool_mapped_bytes(void);
+size_t pool_peak_mapped_bytes(void);
+
+// pages straight from the os for memory that is not cut into size classes,
+// alignment is a power of two and size a multiple of the os page size
+void* pool_map_aligned(size_t size, size_t alignment);
+void pool_unmap(void* memory, size_t size);
+
+void* pool_allocate(size_t size);
+void pool_free(void* pointer, size_t size);
+void* pool_reallocate(void* previous, size_t old_size, size_t new_size);
+
+#endif
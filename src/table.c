@@ -5,88 +5,173 @@
 #include "object.h"
 #include "table.h"
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define TABLE_MAX_LOAD 0.875
+// tables with fewer live entries than this are shrunk
+#define TABLE_MIN_LOAD 0.125
+// deleted slots make probes longer, past this share of the capacity they are cleaned up
+#define TABLE_MAX_TOMBSTONES 0.125
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+// the low 7 bits go into the control byte, the rest picks the first group
+#define HASH_FRAGMENT(hash) ((uint8_t)((hash) & 0x7F))
+#define HASH_GROUP(hash) ((hash) >> 7)
+
+typedef uint32_t group_mask_t;
+
+static inline group_mask_t match_byte(const uint8_t* group, uint8_t byte)
+{
+#ifdef TABLE_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (group_mask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+    group_mask_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        if (group[i] == byte)
+            mask |= (group_mask_t)1 << i;
+    }
+    return mask;
+#endif
+}
+
+// empty and deleted both have the high bit set, full slots never do
+static inline group_mask_t match_free(const uint8_t* group)
+{
+#ifdef TABLE_SSE2
+    return (group_mask_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    group_mask_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        if (group[i] & 0x80)
+            mask |= (group_mask_t)1 << i;
+    }
+    return mask;
+#endif
+}
+
+static inline int lowest_bit(group_mask_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// visits every group exactly once, the group count is a power of two
+#define NEXT_GROUP(group, step, group_mask) (((group) + (step)) & (group_mask))
 
 void init_table(table_t* table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
 void free_table(table_t* table)
 {
     FREE_ARRAY(entry_t, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     init_table(table);
 }
 
-entry_t* find_entry(entry_t* entries, int capacity, obj_string_t* key)
+// returns the slot of key, or -1 and the first free slot on the way in free_slot
+static int find_slot(table_t* table, obj_string_t* key, int* free_slot)
 {
-    uint32_t index = key->hash % capacity;
-    entry_t* tombstone = NULL;
+    uint32_t group_mask = (uint32_t)(table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = HASH_GROUP(key->hash) & group_mask;
+    uint8_t fragment = HASH_FRAGMENT(key->hash);
+    *free_slot = -1;
 
-    while (true)
+    for (uint32_t step = 1; ; step++)
     {
-        entry_t* entry = entries + index;
+        int base = group * TABLE_GROUP_WIDTH;
+        const uint8_t* ctrl = table->control + base;
 
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
+        for (group_mask_t match = match_byte(ctrl, fragment); match != 0; match &= match - 1)
         {
-            return entry;
+            int slot = base + lowest_bit(match);
+            if (table->entries[slot].key == key)
+                return slot;
         }
 
-        index = (index + 1) % capacity;
+        group_mask_t available = match_free(ctrl);
+        if (*free_slot < 0 && available != 0)
+            *free_slot = base + lowest_bit(available);
+        // an empty slot ends the probe sequence, deleted ones do not
+        if (match_byte(ctrl, CTRL_EMPTY) != 0)
+            return -1;
+
+        group = NEXT_GROUP(group, step, group_mask);
     }
 }
 
+static void put_entry(table_t* table, int slot, obj_string_t* key, value_t value)
+{
+    table->control[slot] = HASH_FRAGMENT(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+}
+
 static void adjust_capacity(table_t* table, int capacity)
 {
-    entry_t* entries = ALLOCATE(entry_t, capacity);
+    table_t resized;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.entries = ALLOCATE(entry_t, capacity);
+    resized.control = ALLOCATE(uint8_t, capacity);
+    memset(resized.control, CTRL_EMPTY, capacity);
     for (int i = 0; i < capacity; ++i)
     {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+        resized.entries[i].key = NULL;
+        resized.entries[i].value = NIL_VAL;
     }
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; ++i)
     {
         entry_t* entry = table->entries + i;
         if (entry->key == NULL)
             continue;
 
-        entry_t* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        int slot;
+        find_slot(&resized, entry->key, &slot);
+        put_entry(&resized, slot, entry->key, entry->value);
+        resized.count++;
     }
 
     FREE_ARRAY(entry_t, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
+    *table = resized;
 }
 
 bool table_get(table_t* table, obj_string_t* key, value_t* value)
 {
-    if (table->entries == NULL)
+    if (table->count == 0)
         return false;
 
-    entry_t* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int free_slot;
+    int slot = find_slot(table, key, &free_slot);
+    if (slot < 0)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
@@ -94,21 +179,25 @@ bool table_set(table_t* table, obj_string_t* key, value_t value)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
+        int capacity = table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : table->capacity * 2;
         adjust_capacity(table, capacity);
     }
 
-    entry_t* entry = find_entry(table->entries, table->capacity, key);
-
-    bool newKey = entry->key == NULL;
-    if (newKey && IS_NIL(entry->value))
+    int free_slot;
+    int slot = find_slot(table, key, &free_slot);
+    if (slot >= 0)
     {
-        table->count++;
+        table->entries[slot].value = value;
+        return false;
     }
 
-    entry->key = key;
-    entry->value = value;
-    return newKey;
+    // reusing a deleted slot does not add to the count
+    if (table->control[free_slot] == CTRL_EMPTY)
+        table->count++;
+    else
+        table->tombstones--;
+    put_entry(table, free_slot, key, value);
+    return true;
 }
 
 bool table_delete(table_t* table, obj_string_t* key)
@@ -116,16 +205,153 @@ bool table_delete(table_t* table, obj_string_t* key)
     if (table->count == 0)
         return false;
 
-    entry_t* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int free_slot;
+    int slot = find_slot(table, key, &free_slot);
+    if (slot < 0)
         return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // no probe runs past a group with an empty slot, so the slot can simply become empty
+    int base = slot - slot % TABLE_GROUP_WIDTH;
+    if (match_byte(table->control + base, CTRL_EMPTY) != 0)
+    {
+        table->control[slot] = CTRL_EMPTY;
+        table->count--;
+    }
+    else
+    {
+        table->control[slot] = CTRL_DELETED;
+        table->tombstones++;
+    }
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
 
     return true;
 }
 
+static int find_free_slot(table_t* table, uint32_t hash)
+{
+    uint32_t group_mask = (uint32_t)(table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = HASH_GROUP(hash) & group_mask;
+
+    for (uint32_t step = 1; ; step++)
+    {
+        int base = group * TABLE_GROUP_WIDTH;
+        group_mask_t available = match_free(table->control + base);
+        if (available != 0)
+            return base + lowest_bit(available);
+
+        group = NEXT_GROUP(group, step, group_mask);
+    }
+}
+
+// rehashes at the same capacity by swapping entries around, deleted slots are marked
+// empty and full ones deleted first, which then means "still to be placed"
+static void purge_deleted(table_t* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+        table->control[i] = (table->control[i] & 0x80) ? CTRL_EMPTY : CTRL_DELETED;
+
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->control[i] != CTRL_DELETED)
+            continue;
+
+        obj_string_t* key = table->entries[i].key;
+        int target = find_free_slot(table, key->hash);
+
+        // the entry already sits in the first group of its probe sequence with room in it
+        if (target / TABLE_GROUP_WIDTH == i / TABLE_GROUP_WIDTH)
+        {
+            table->control[i] = HASH_FRAGMENT(key->hash);
+            continue;
+        }
+
+        if (table->control[target] == CTRL_EMPTY)
+        {
+            put_entry(table, target, key, table->entries[i].value);
+            table->control[i] = CTRL_EMPTY;
+            table->entries[i].key = NULL;
+            table->entries[i].value = NIL_VAL;
+        }
+        else
+        {
+            // the target still waits for its own place, swap and look at slot i again
+            entry_t waiting = table->entries[target];
+            put_entry(table, target, key, table->entries[i].value);
+            table->entries[i] = waiting;
+            i--;
+        }
+    }
+
+    table->count -= table->tombstones;
+    table->tombstones = 0;
+}
+
+// moves the live entries to the back, reinserts them at the front and cuts the arrays down.
+// the front part can not reach the moved entries as long as they fit in half of it.
+static void shrink_in_place(table_t* table, int capacity)
+{
+    int old_capacity = table->capacity;
+
+    int back = old_capacity;
+    for (int i = old_capacity - 1; i >= 0; i--)
+    {
+        if (table->entries[i].key != NULL)
+            table->entries[--back] = table->entries[i];
+    }
+
+    memset(table->control, CTRL_EMPTY, capacity);
+    for (int i = 0; i < capacity; i++)
+    {
+        table->entries[i].key = NULL;
+        table->entries[i].value = NIL_VAL;
+    }
+
+    table->capacity = capacity;
+    table->count = 0;
+    table->tombstones = 0;
+    for (int i = back; i < old_capacity; i++)
+    {
+        entry_t* entry = table->entries + i;
+        put_entry(table, find_free_slot(table, entry->key->hash), entry->key, entry->value);
+        table->count++;
+    }
+
+    // shrinking never starts a collection
+    table->entries = GROW_ARRAY(table->entries, entry_t, old_capacity, capacity);
+    table->control = GROW_ARRAY(table->control, uint8_t, old_capacity, capacity);
+}
+
+void table_tidy(table_t* table)
+{
+    if (table->capacity == 0)
+        return;
+
+    int live = table->count - table->tombstones;
+    if (live == 0)
+    {
+        free_table(table);
+        return;
+    }
+
+    if (table->capacity > TABLE_GROUP_WIDTH && live < table->capacity * TABLE_MIN_LOAD)
+    {
+        // leave room to grow again before the next resize
+        int capacity = table->capacity;
+        while (capacity / 2 >= TABLE_GROUP_WIDTH && live <= capacity / 2 * TABLE_MAX_LOAD / 2)
+            capacity /= 2;
+
+        if (capacity < table->capacity)
+        {
+            shrink_in_place(table, capacity);
+            return;
+        }
+    }
+
+    if (table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES)
+        purge_deleted(table);
+}
+
 void table_add_all(table_t* from, table_t* to)
 {
     for (int i = 0; i < from->capacity; ++i)
@@ -140,29 +366,90 @@ void table_add_all(table_t* from, table_t* to)
 
 obj_string_t* table_find_string(table_t* table, const char* chars, int length, uint32_t hash)
 {
-    if (table->entries == NULL)
+    if (table->count == 0)
         return NULL;
 
-    uint32_t index = hash % table->capacity;
+    uint32_t group_mask = (uint32_t)(table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = HASH_GROUP(hash) & group_mask;
+    uint8_t fragment = HASH_FRAGMENT(hash);
 
-    while (true)
+    for (uint32_t step = 1; ; step++)
     {
-        entry_t* entry = table->entries + index;
+        int base = group * TABLE_GROUP_WIDTH;
+        const uint8_t* ctrl = table->control + base;
 
-        if (entry->key == NULL)
+        for (group_mask_t match = match_byte(ctrl, fragment); match != 0; match &= match - 1)
         {
-            // stop if we find an empty non-tombstone entry
-            if (IS_NIL(entry->value))
-                return NULL;
+            obj_string_t* key = table->entries[base + lowest_bit(match)].key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0)
+                return key;
         }
-        else if (entry->key->length ==length
-              && entry->key->hash == hash
-              && memcmp(entry->key->chars, chars, length) == 0)
+
+        if (match_byte(ctrl, CTRL_EMPTY) != 0)
+            return NULL;
+
+        group = NEXT_GROUP(group, step, group_mask);
+    }
+}
+
+void table_remove_white(table_t* table)
+{
+    table_remove_white_range(table, 0, table->capacity);
+}
+
+void table_remove_white_range(table_t* table, int from, int to)
+{
+    for (int i = from; i < to; ++i)
+    {
+        entry_t* entry = table->entries + i;
+        if (entry->key != NULL && !is_object_live((obj_t*)entry->key))
+            table_delete(table, entry->key);
+    }
+}
+
+int table_probe_length(table_t* table, obj_string_t* key, int* compares)
+{
+    uint32_t group_mask = (uint32_t)(table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = HASH_GROUP(key->hash) & group_mask;
+    uint8_t fragment = HASH_FRAGMENT(key->hash);
+    *compares = 0;
+
+    for (uint32_t step = 1; ; step++)
+    {
+        int base = group * TABLE_GROUP_WIDTH;
+
+        for (group_mask_t match = match_byte(table->control + base, fragment); match != 0; match &= match - 1)
         {
-            // found the string!
-            return entry->key;
+            (*compares)++;
+            if (table->entries[base + lowest_bit(match)].key == key)
+                return (int)step;
         }
 
-        index = (index + 1) % table->capacity;
+        group = NEXT_GROUP(group, step, group_mask);
+    }
+}
+
+void mark_table(table_t* table)
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        entry_t* entry = table->entries + i;
+        mark_object((obj_t*)entry->key);
+        mark_value(entry->value);
+    }
+}
+
+void table_forward_references(table_t* table, obj_t* (*forward)(obj_t* obj))
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        entry_t* entry = table->entries + i;
+        if (entry->key == NULL)
+            continue;
+
+        // the slot depends on the string hash only, so the entry stays where it is
+        entry->key = (obj_string_t*)forward((obj_t*)entry->key);
+        if (IS_OBJ(entry->value))
+            entry->value = OBJ_VAL(forward(AS_OBJ(entry->value)));
     }
 }
@@ -9,10 +9,20 @@ typedef struct {
     value_t value;
 } entry_t;
 
+// slots are probed in groups of this many control bytes at once
+#define TABLE_GROUP_WIDTH 16
+
+// open addressing with a control byte per slot holding 7 bits of the hash, so a whole
+// group of slots is matched with a few vector instructions before any key is touched.
+// empty and deleted slots have a NULL key in entries.
 typedef struct {
+    // used slots including deleted ones
     int count;
+    int tombstones;
+    // a power of two and a multiple of the group width
     int capacity;
     entry_t* entries;
+    uint8_t* control;
 } table_t;
 
 void init_table(table_t* table);
@@ -25,5 +35,16 @@ bool table_set(table_t* table, obj_string_t* key, value_t value);
 bool table_delete(table_t* table, obj_string_t* key);
 void table_add_all(table_t* from, table_t* to);
 obj_string_t* table_find_string(table_t* table, const char* chars, int length, uint32_t hash);
+// removes all entries whose key was not marked by the collector
+void table_remove_white(table_t* table);
+void table_remove_white_range(table_t* table, int from, int to);
+// drops deleted slots and shrinks sparse tables without allocating.
+// entries move, so nothing may be walking the table.
+void table_tidy(table_t* table);
+// number of groups a lookup of key visits and keys it compares, key has to be in the table
+int table_probe_length(table_t* table, obj_string_t* key, int* compares);
+void mark_table(table_t* table);
+// rewrites keys and object values after the collector moved objects
+void table_forward_references(table_t* table, obj_t* (*forward)(obj_t* obj));
 
 #endif
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+#include "thread.h"
+
+typedef struct {
+    thread_func_t func;
+    void* arg;
+} thread_start_t;
+
+#ifdef _WIN32
+
+static DWORD WINAPI thread_entry(LPVOID param)
+{
+    thread_start_t start = *(thread_start_t*)param;
+    free(param);
+    start.func(start.arg);
+    return 0;
+}
+
+bool thread_start(thread_t* thread, thread_func_t func, void* arg)
+{
+    thread_start_t* start = malloc(sizeof(thread_start_t));
+    if (start == NULL)
+        return false;
+    start->func = func;
+    start->arg = arg;
+
+    *thread = CreateThread(NULL, 0, thread_entry, start, 0, NULL);
+    if (*thread == NULL)
+    {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+void thread_join(thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void thread_yield(void)
+{
+    SwitchToThread();
+}
+
+void mutex_init(mutex_t* mutex) { InitializeCriticalSection(mutex); }
+void mutex_destroy(mutex_t* mutex) { DeleteCriticalSection(mutex); }
+void mutex_lock(mutex_t* mutex) { EnterCriticalSection(mutex); }
+void mutex_unlock(mutex_t* mutex) { LeaveCriticalSection(mutex); }
+
+void cond_init(cond_t* cond) { InitializeConditionVariable(cond); }
+void cond_destroy(cond_t* cond) { (void)cond; }
+void cond_wait(cond_t* cond, mutex_t* mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+void cond_broadcast(cond_t* cond) { WakeAllConditionVariable(cond); }
+
+#else
+
+static void* thread_entry(void* param)
+{
+    thread_start_t start = *(thread_start_t*)param;
+    free(param);
+    start.func(start.arg);
+    return NULL;
+}
+
+bool thread_start(thread_t* thread, thread_func_t func, void* arg)
+{
+    thread_start_t* start = malloc(sizeof(thread_start_t));
+    if (start == NULL)
+        return false;
+    start->func = func;
+    start->arg = arg;
+
+    if (pthread_create(thread, NULL, thread_entry, start) != 0)
+    {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+void thread_join(thread_t thread)
+{
+    pthread_join(thread, NULL);
+}
+
+void thread_yield(void)
+{
+    sched_yield();
+}
+
+void mutex_init(mutex_t* mutex) { pthread_mutex_init(mutex, NULL); }
+void mutex_destroy(mutex_t* mutex) { pthread_mutex_destroy(mutex); }
+void mutex_lock(mutex_t* mutex) { pthread_mutex_lock(mutex); }
+void mutex_unlock(mutex_t* mutex) { pthread_mutex_unlock(mutex); }
+
+void cond_init(cond_t* cond) { pthread_cond_init(cond, NULL); }
+void cond_destroy(cond_t* cond) { pthread_cond_destroy(cond); }
+void cond_wait(cond_t* cond, mutex_t* mutex) { pthread_cond_wait(cond, mutex); }
+void cond_broadcast(cond_t* cond) { pthread_cond_broadcast(cond); }
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef clox_thread_h
+#define clox_thread_h
+
+#include "common.h"
+
+// minimal portable threading used by the parallel marker
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define THREAD_LOCAL __declspec(thread)
+
+// returns the previous value
+#define atomic_exchange_bool(ptr) (_InterlockedExchange8((volatile char*)(ptr), 1) != 0)
+#define atomic_load_bool(ptr) (*(volatile bool*)(ptr))
+#define atomic_increment(ptr) _InterlockedIncrement((volatile long*)(ptr))
+#define atomic_decrement(ptr) _InterlockedDecrement((volatile long*)(ptr))
+#define atomic_load_int(ptr) (*(volatile long*)(ptr))
+#else
+#include <pthread.h>
+
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+#define THREAD_LOCAL __thread
+
+// returns the previous value
+#define atomic_exchange_bool(ptr) __atomic_exchange_n((ptr), true, __ATOMIC_ACQ_REL)
+#define atomic_load_bool(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define atomic_increment(ptr) __atomic_add_fetch((ptr), 1, __ATOMIC_ACQ_REL)
+#define atomic_decrement(ptr) __atomic_sub_fetch((ptr), 1, __ATOMIC_ACQ_REL)
+#define atomic_load_int(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#endif
+
+typedef void(*thread_func_t)(void* arg);
+
+bool thread_start(thread_t* thread, thread_func_t func, void* arg);
+void thread_join(thread_t thread);
+void thread_yield(void);
+
+void mutex_init(mutex_t* mutex);
+void mutex_destroy(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+void cond_wait(cond_t* cond, mutex_t* mutex);
+void cond_broadcast(cond_t* cond);
+
+#endif
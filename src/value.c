@@ -33,17 +33,37 @@ void write_value_array(value_array_t* array, value_t value)
 
 void print_value(value_t value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+        printf(AS_BOOL(value) ? "true" : "false");
+    else if (IS_NIL(value))
+        printf("nil");
+    else if (IS_NUMBER(value))
+        printf("%g", AS_NUMBER(value));
+    else if (IS_OBJ(value))
+        print_object(value);
+#else
     switch (value.type)
     {
     case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
     case VAL_OBJ: print_object(value); break;
+    case VAL_UNDEFINED: break;
     }
+#endif
 }
 
 bool values_equal(value_t a, value_t b)
 {
+#ifdef NAN_BOXING
+    // compare numbers as doubles so NaN != NaN and 0 == -0, like the tagged version
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    if (IS_STRING(a) && IS_STRING(b))
+        return strings_equal(AS_STRING(a), AS_STRING(b));
+    return a == b;
+#else
     if (a.type != b.type) return false;
 
     switch (a.type)
@@ -51,7 +71,12 @@ bool values_equal(value_t a, value_t b)
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+        if (IS_STRING(a) && IS_STRING(b))
+            return strings_equal(AS_STRING(a), AS_STRING(b));
+        return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_UNDEFINED: return true;
     }
     return false;
+#endif
 }
@@ -6,11 +6,67 @@
 typedef struct sobj_t obj_t;
 typedef struct sobj_string_t obj_string_t;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// every value is a single 64 bit word. numbers are stored as plain doubles,
+// everything else hides in the payload of a quiet NaN:
+//   nil/bool  QNAN | tag
+//   obj       SIGN_BIT | QNAN | pointer
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE  3 // 11
+// 00 is never seen by lox code, it marks globals that are not defined yet
+#define TAG_UNDEFINED 0
+
+typedef uint64_t value_t;
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_num(value)
+#define AS_OBJ(value) ((obj_t*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((value_t)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((value_t)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL ((value_t)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((value_t)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) num_to_value(num)
+#define OBJ_VAL(object) (value_t)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+// memcpy keeps the type punning well defined, compilers turn it into a register move
+static inline double value_to_num(value_t value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(value_t));
+    return num;
+}
+
+static inline value_t num_to_value(double num)
+{
+    value_t value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    // never seen by lox code, it marks globals that are not defined yet
+    VAL_UNDEFINED
 } value_type_t;
 
 typedef struct {
@@ -26,6 +82,7 @@ typedef struct {
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -33,9 +90,12 @@ typedef struct {
 
 #define BOOL_VAL(value) ((value_t){ VAL_BOOL, { .boolean = (value) } })
 #define NIL_VAL ((value_t){ VAL_NIL, { .number = 0 } })
+#define UNDEFINED_VAL ((value_t){ VAL_UNDEFINED, { .number = 0 } })
 #define NUMBER_VAL(value) ((value_t){ VAL_NUMBER, { .number = (value) } })
 #define OBJ_VAL(object) ((value_t){ VAL_OBJ, { .obj = (obj_t*)(object) } })
 
+#endif
+
 typedef struct {
     int count;
     int capacity;
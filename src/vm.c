@@ -1,5 +1,7 @@
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -8,6 +10,7 @@
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "pool.h"
 #include "vm.h"
 
 const char* INTERPRET_RESULT_STRING[] = {
@@ -16,7 +19,7 @@ const char* INTERPRET_RESULT_STRING[] = {
     "RUNTIME_ERROR"
 };
 
-vm_t vm;
+CACHE_ALIGNED vm_t vm;
 
 static void runtime_error(const char* format, ...);
 
@@ -30,6 +33,9 @@ static value_t printf_native(int argCount, value_t* args)
     if (argCount == 0)
         runtime_error("printf expects format string following by values: printf(format_string, ...)");
 
+    if (IS_ROPE(*args))
+        *args = OBJ_VAL(flatten_rope(AS_ROPE(*args)));
+
     // first arg is format string
     if (IS_OBJ(*args) && IS_STRING(*args))
     {
@@ -59,6 +65,150 @@ static value_t printf_native(int argCount, value_t* args)
     return NIL_VAL;
 }
 
+// mem_stats() prints the memory report and returns the live heap size,
+// mem_stats(name) returns a single counter, e.g. "peak" or "string", or nil for unknown names
+static value_t mem_stats_native(int argCount, value_t* args)
+{
+    mem_stats_t* stats = &vm.mem_stats;
+
+    if (argCount == 0)
+    {
+        print_mem_stats();
+        return NUMBER_VAL((double)vm.bytes_allocated);
+    }
+
+    if (IS_ROPE(*args))
+        *args = OBJ_VAL(flatten_rope(AS_ROPE(*args)));
+    if (!IS_OBJ(*args) || !IS_STRING(*args))
+        return NIL_VAL;
+
+    // string constants are not null terminated
+    obj_string_t* arg = AS_STRING(*args);
+    char name[32];
+    if (arg->length >= (int)sizeof(name))
+        return NIL_VAL;
+    memcpy(name, arg->chars, arg->length);
+    name[arg->length] = '\0';
+
+    if (strcmp(name, "live") == 0)
+        return NUMBER_VAL((double)vm.bytes_allocated);
+    if (strcmp(name, "peak") == 0)
+        return NUMBER_VAL((double)stats->peak);
+    if (strcmp(name, "allocated") == 0)
+        return NUMBER_VAL((double)stats->total_allocated);
+    if (strcmp(name, "freed") == 0)
+        return NUMBER_VAL((double)stats->total_freed);
+    if (strcmp(name, "resident") == 0 || strcmp(name, "peak_resident") == 0)
+    {
+        size_t resident, peak_resident;
+        resident_bytes(&resident, &peak_resident);
+        return NUMBER_VAL((double)(name[0] == 'r' ? resident : peak_resident));
+    }
+
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        if (strcmp(name, OBJ_TYPE_NAMES[i]) == 0)
+            return NUMBER_VAL((double)stats->live_objects[i]);
+    }
+
+    // allocation counts per site are prefixed to keep them apart from the object types
+    if (strncmp(name, "alloc_", 6) == 0)
+    {
+        for (int i = 0; i < ALLOC_SITE_COUNT; i++)
+        {
+            if (strcmp(name + 6, ALLOC_SITE_NAMES[i]) == 0)
+                return NUMBER_VAL((double)stats->site_allocations[i]);
+        }
+    }
+
+    return NIL_VAL;
+}
+
+// arguments live on the stack, so a rope can be flattened in place
+static obj_string_t* string_arg(value_t* arg)
+{
+    if (IS_ROPE(*arg))
+        *arg = OBJ_VAL(flatten_rope(AS_ROPE(*arg)));
+    return IS_STRING(*arg) ? AS_STRING(*arg) : NULL;
+}
+
+// substr(s, start) or substr(s, start, length), out of range parts are cut off
+static value_t substr_native(int argCount, value_t* args)
+{
+    if (argCount < 2 || !IS_NUMBER(args[1]) || (argCount > 2 && !IS_NUMBER(args[2])))
+        return NIL_VAL;
+    obj_string_t* str = string_arg(args);
+    if (str == NULL)
+        return NIL_VAL;
+
+    int start = (int)AS_NUMBER(args[1]);
+    if (start < 0)
+        start = 0;
+    if (start > str->length)
+        start = str->length;
+
+    int length = str->length - start;
+    if (argCount > 2 && (int)AS_NUMBER(args[2]) < length)
+        length = (int)AS_NUMBER(args[2]);
+    if (length < 0)
+        length = 0;
+
+    return OBJ_VAL(slice_string(str, start, length));
+}
+
+// split(s, separator, index) returns the field at index, or nil if there are fewer fields
+static value_t split_native(int argCount, value_t* args)
+{
+    if (argCount < 3 || !IS_NUMBER(args[2]))
+        return NIL_VAL;
+    obj_string_t* sep = string_arg(args + 1);
+    obj_string_t* str = string_arg(args);
+    if (str == NULL || sep == NULL || sep->length == 0)
+        return NIL_VAL;
+
+    int index = (int)AS_NUMBER(args[2]);
+    if (index < 0)
+        return NIL_VAL;
+
+    int start = 0;
+    for (int i = 0; i + sep->length <= str->length; )
+    {
+        if (memcmp(str->chars + i, sep->chars, sep->length) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        if (index-- == 0)
+            return OBJ_VAL(slice_string(str, start, i - start));
+        i += sep->length;
+        start = i;
+    }
+
+    if (index == 0)
+        return OBJ_VAL(slice_string(str, start, str->length - start));
+    return NIL_VAL;
+}
+
+// trim(s) drops leading and trailing whitespace
+static value_t trim_native(int argCount, value_t* args)
+{
+    if (argCount < 1)
+        return NIL_VAL;
+    obj_string_t* str = string_arg(args);
+    if (str == NULL)
+        return NIL_VAL;
+
+    int start = 0;
+    int end = str->length;
+    while (start < end && isspace((unsigned char)str->chars[start]))
+        start++;
+    while (end > start && isspace((unsigned char)str->chars[end - 1]))
+        end--;
+
+    return OBJ_VAL(slice_string(str, start, end - start));
+}
+
 static void reset_stack(void)
 {
     vm.stack_top = vm.stack;
@@ -85,38 +235,139 @@ static void runtime_error(const char* format, ...)
         if (func->name == NULL)
             fprintf(stderr, "script\n");
         else
-            fprintf(stderr, "%s()\n", func->name->chars);
+            fprintf(stderr, "%.*s()\n", func->name->length, func->name->chars);
     }
     fputs("----------------------------\n", stderr);
 
     reset_stack();
 }
 
+int global_slot(obj_string_t* name)
+{
+    value_t slot;
+    if (table_get(&vm.global_names, name, &slot))
+        return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    write_value_array(&vm.global_values, UNDEFINED_VAL);
+    table_set(&vm.global_names, name, NUMBER_VAL(vm.global_values.count - 1));
+    // the table is a root, a cycle that already scanned it would miss the new name
+    write_barrier_value(OBJ_VAL(name));
+    pop();
+    return vm.global_values.count - 1;
+}
+
+obj_string_t* global_name(int slot)
+{
+    for (int i = 0; i < vm.global_names.capacity; i++)
+    {
+        entry_t* entry = vm.global_names.entries + i;
+        if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot)
+            return entry->key;
+    }
+    return NULL;
+}
+
 static void define_native(const char* name, native_func_t func)
 {
-    push(OBJ_VAL(copy_string(name, (int)strlen(name))));
+    // native names are string literals of the interpreter itself
+    int slot = global_slot(borrow_string(name, (int)strlen(name)));
     push(OBJ_VAL(new_native(func)));
-    table_set(&(vm.globals), AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
+    vm.global_values.values[slot] = vm.stack[0];
+    write_barrier_value(vm.stack[0]);
     pop();
 }
 
 void init_vm(void)
 {
+    init_pool();
     reset_stack();
-    init_table(&vm.globals);
-    init_table(&vm.strings);
     vm.objects = NULL;
+    vm.bytes_allocated = 0;
+    vm.next_gc = GC_INITIAL_HEAP;
+    vm.gc_grow_factor = GC_HEAP_GROW_FACTOR;
+    vm.gc_threads = 1;
+    vm.gc_compact = false;
+    vm.compact_pending = false;
+    vm.pages = NULL;
+    vm.specialize = true;
+
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.gray_stack = NULL;
+
+#ifdef GC_GENERATIONAL
+    init_nursery(&vm.nursery);
+#endif
+
+#ifdef GC_INCREMENTAL
+    vm.gc_phase = GC_PHASE_IDLE;
+    vm.gc_step_budget_us = GC_DEFAULT_STEP_BUDGET_US;
+    vm.gc_next_step = 0;
+    vm.gc_backedges = 0;
+    vm.sweep_previous = NULL;
+    vm.sweep_current = NULL;
+#endif
+
+    memset(&vm.gc_pauses, 0, sizeof(vm.gc_pauses));
+    vm.alloc_site = ALLOC_SITE_RUNTIME;
+    memset(&vm.mem_stats, 0, sizeof(vm.mem_stats));
+
+    init_table(&vm.global_names);
+    init_value_array(&vm.global_values);
+    init_table(&vm.strings);
+    vm.sources = NULL;
 
     define_native("clock", clock_native);
     define_native("printf", printf_native);
+    define_native("mem_stats", mem_stats_native);
+    define_native("substr", substr_native);
+    define_native("split", split_native);
+    define_native("trim", trim_native);
 }
 
 void free_vm(void)
 {
-    free_table(&vm.globals);
+    free_table(&vm.global_names);
+    free_value_array(&vm.global_values);
     free_table(&vm.strings);
     free_objects();
+    free_pool();
+
+    while (vm.sources != NULL)
+    {
+        source_buffer_t* next = vm.sources->next;
+        free(vm.sources);
+        vm.sources = next;
+    }
+}
+
+char* allocate_source(size_t size)
+{
+    source_buffer_t* buffer = malloc(sizeof(source_buffer_t) + size);
+    if (buffer == NULL)
+        return NULL;
+
+    buffer->next = vm.sources;
+    vm.sources = buffer;
+    return buffer->text;
+}
+
+static const char* retain_source(const char* source)
+{
+    // sources read through allocate_source are used in place
+    for (source_buffer_t* buffer = vm.sources; buffer != NULL; buffer = buffer->next)
+    {
+        if (buffer->text == source)
+            return source;
+    }
+
+    size_t size = strlen(source) + 1;
+    char* text = allocate_source(size);
+    if (text == NULL)
+        exit(1);
+    memcpy(text, source, size);
+    return text;
 }
 
 static value_t peek(int distance)
@@ -156,7 +407,9 @@ static bool call_value(value_t callee, uint8_t argCount)
             return call(AS_CLOSURE(callee), argCount);
         case OBJ_NATIVE: {
             native_func_t func = AS_NATIVE(callee);
+            vm.alloc_site = ALLOC_SITE_NATIVE;
             value_t result = func(argCount, vm.stack_top - argCount);
+            vm.alloc_site = ALLOC_SITE_RUNTIME;
             vm.stack_top -= argCount + 1;
             push(result);
             return true;
@@ -204,6 +457,7 @@ static void close_upvalues(value_t* last)
         obj_upvalue_t* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &(upvalue->closed);
+        write_barrier((obj_t*)upvalue);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -215,299 +469,76 @@ static bool isFalsey(value_t value)
 
 static void concatenate()
 {
-    obj_string_t* b = AS_STRING(pop());
-    obj_string_t* a = AS_STRING(pop());
+    // operands stay on the stack until the result exists, allocating may collect
+    obj_t* result;
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))
+        && AS_STRING(peek(0))->length + AS_STRING(peek(1))->length < ROPE_MIN_LENGTH)
+    {
+        obj_string_t* b = AS_STRING(peek(0));
+        obj_string_t* a = AS_STRING(peek(1));
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+        obj_string_t* str = new_string(a->length + b->length);
+        memcpy(str->chars, a->chars, a->length);
+        memcpy(str->chars + a->length, b->chars, b->length);
+        result = (obj_t*)str;
+    }
+    else
+    {
+        result = (obj_t*)new_rope(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
+    }
 
-    obj_string_t* result = take_string(chars, length);
+    pop();
+    pop();
     push(OBJ_VAL(result));
 }
 
-static interpret_result_t run(bool traceExecution)
+// ropes are compared and printed through their flat string
+static void flatten_slot(value_t* slot)
 {
-    call_frame_t* frame = &(vm.frames[vm.frame_count - 1]);
-
-#define READ_BYTE() (*(frame->ip++))
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-
-#define CONSTANT_LONG(name) int constIndex = 0; \
-    constIndex |= ((int)READ_BYTE() << 16); \
-    constIndex |= ((int)READ_BYTE() << 8); \
-    constIndex |= READ_BYTE(); \
-    value_t name = frame->closure->function->chunk.constants.values[constIndex]
-
-#define STRING_LONG(name) CONSTANT_LONG(constant); \
-    obj_string_t* name = AS_STRING(constant)
-
-#define BINARY_OP(valueType, op) \
-    do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtime_error("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR; \
-        } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
-    } while (false)
-
-    for (;;)
-    {
-//#ifdef DEBUG_TRACE_EXECUTION
-        if (traceExecution)
-        {
-            printf("          ");
-            for (value_t* slot = vm.stack; slot < vm.stack_top; slot++)
-            {
-                printf("[ ");
-                print_value(*slot);
-                printf(" ]");
-            }
-            printf("\n");
-            disassemble_instruction(&(frame->closure->function->chunk), (int)(frame->ip - frame->closure->function->chunk.code));
-        }
-//#endif
-
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-        case OP_CONSTANT: {
-            value_t constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-
-        case OP_CONSTANT_LONG: {
-            CONSTANT_LONG(constant);
-            push(constant);
-            break;
-        }
-
-        case OP_NIL: push(NIL_VAL); break;
-        case OP_TRUE: push(BOOL_VAL(true)); break;
-        case OP_FALSE: push(BOOL_VAL(false)); break;
-        case OP_POP: pop(); break;
-
-        case OP_POPN: {
-            uint8_t n = READ_BYTE();
-            vm.stack_top -= n;
-            break;
-        }
-
-        case OP_GET_LOCAL: {
-            uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
-        }
-
-        case OP_GET_GLOBAL: {
-            obj_string_t* name = READ_STRING();
-            value_t value;
-            if (!table_get(&vm.globals, name, &value))
-            {
-                runtime_error("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(value);
-            break;
-        }
-
-        case OP_GET_GLOBAL_LONG: {
-            STRING_LONG(name);
-            value_t value;
-            if (!table_get(&vm.globals, name, &value))
-            {
-                runtime_error("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(value);
-            break;
-        }
-
-        case OP_DEFINE_GLOBAL: {
-            obj_string_t* name = READ_STRING();
-            table_set(&vm.globals, name, peek(0));
-            pop();
-            break;
-        }
-
-        case OP_DEFINE_GLOBAL_LONG: {
-            STRING_LONG(name);
-            table_set(&vm.globals, name, peek(0));
-            pop();
-            break;
-        }
-
-        case OP_SET_LOCAL: {
-            uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
-        }
-
-        case OP_SET_GLOBAL: {
-            obj_string_t* name = READ_STRING();
-            if (table_set(&vm.globals, name, peek(0)))
-            {
-                runtime_error("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-
-        case OP_SET_GLOBAL_LONG: {
-            STRING_LONG(name);
-            if (table_set(&vm.globals, name, peek(0)))
-            {
-                runtime_error("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-
-        case OP_GET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
-        }
-
-        case OP_SET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
-        }
-
-        case OP_EQUAL: {
-            value_t a = pop();
-            value_t b = pop();
-            push(BOOL_VAL(values_equal(a, b)));
-            break;
-        }
-
-        case OP_GREATER:    BINARY_OP(BOOL_VAL, >); break;
-        case OP_LESS:       BINARY_OP(BOOL_VAL, <); break;
-        case OP_ADD: {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-            {
-                concatenate();
-            }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-            {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
-            }
-            else
-            {
-                runtime_error("Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-        case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *); break;
-        case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /); break;
-        case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
-            {
-                runtime_error("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-
-        case OP_PRINT: {
-            print_value(pop());
-            printf("\n");
-            break;
-        }
-
-        case OP_JUMP: {
-            uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
-        }
-
-        case OP_JUMP_IF_FALSE: {
-            uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
-            {
-                frame->ip += offset;
-            }
-            break;
-        }
-
-        case OP_LOOP: {
-            uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
-        }
-
-        case OP_CALL: {
-            uint8_t argCount = READ_BYTE();
-            if (!call_value(peek(argCount), argCount))
-            {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &(vm.frames[vm.frame_count - 1]);
-            break;
-        }
-
-        case OP_CLOSURE: {
-            obj_function_t* func = AS_FUNCTION(READ_CONSTANT());
-            obj_closure_t* clos = new_closure(func);
-            push(OBJ_VAL(clos));
-            for (int i = 0; i < clos->upvalueCount; i++)
-            {
-                uint8_t isLocal = READ_BYTE();
-                uint8_t index = READ_BYTE();
-                if (isLocal)
-                    clos->upvalues[i] = capture_upvalue(frame->slots + index);
-                else
-                    clos->upvalues[i] = frame->closure->upvalues[index];
-            }
-            break;
-        }
-
-        case OP_CLOSE_UPVALUE:
-            close_upvalues(vm.stack_top - 1);
-            pop();
-            break;
-
-        case OP_RETURN: {
-            value_t result = pop();
+    if (IS_ROPE(*slot))
+        *slot = OBJ_VAL(flatten_rope(AS_ROPE(*slot)));
+}
 
-            close_upvalues(frame->slots);
+static void trace_instruction(call_frame_t* frame)
+{
+    printf("          ");
+    for (value_t* slot = vm.stack; slot < vm.stack_top; slot++)
+    {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(&(frame->closure->function->chunk), (int)(frame->ip - frame->closure->function->chunk.code));
+}
 
-            vm.frame_count--;
-            if (vm.frame_count == 0)
-                return INTERPRET_OK;
+#define RUN_FUNCTION run
+#include "vm_loop.h"
 
-            vm.stack_top = frame->slots;
-            push(result);
-            
-            frame = &(vm.frames[vm.frame_count - 1]);
-            break;
-        }
-        }
-    }
+#define RUN_FUNCTION run_traced
+#define RUN_TRACE
+#include "vm_loop.h"
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef BINARY_OP
-}
+#define RUN_FUNCTION run_profiled
+#define RUN_PROFILE
+#include "vm_loop.h"
 
 interpret_result_t interpret(const char* source, interpreter_params_t* params)
 {
-    obj_function_t* func = compile(source, params->print_disassembly);
+    if (params->gc_grow_factor > 1.0)
+        vm.gc_grow_factor = params->gc_grow_factor;
+    if (params->gc_threads > 0)
+        vm.gc_threads = params->gc_threads;
+    vm.gc_compact = params->gc_compact;
+    vm.specialize = params->specialize;
+    pool_use_huge_pages(params->huge_pages);
+#ifdef GC_INCREMENTAL
+    if (params->gc_step_budget_us > 0)
+        vm.gc_step_budget_us = params->gc_step_budget_us;
+#endif
+
+    // the repl reuses its line buffer, so that source is copied
+    obj_function_t* func = compile(retain_source(source), params->print_disassembly, params->optimize_code);
     if (func == NULL)
         return INTERPRET_COMPILE_ERROR;
 
@@ -517,7 +548,11 @@ interpret_result_t interpret(const char* source, interpreter_params_t* params)
     push(OBJ_VAL(closure));
     call_value(OBJ_VAL(closure), 0);
 
-    return run(params->trace_execution);
+    if (params->trace_execution)
+        return run_traced();
+    if (params->profile_opcodes)
+        return run_profiled();
+    return run();
 }
 
 void push(value_t value)
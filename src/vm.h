@@ -2,6 +2,7 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -15,10 +16,31 @@ typedef struct {
     value_t* slots;
 } call_frame_t;
 
+// source code stays alive as long as the vm, string constants point into it
+typedef struct ssource_buffer_t {
+    struct ssource_buffer_t* next;
+    char text[];
+} source_buffer_t;
+
 typedef struct {
     const char* file_path;
     bool trace_execution;
     bool print_disassembly;
+    // run the peephole pass over every compiled chunk
+    bool optimize_code;
+    // quicken and fuse instructions
+    bool specialize;
+    // heap size after a collection is multiplied by this to get the next threshold
+    double gc_grow_factor;
+    // longest time a single incremental collection step may take
+    int gc_step_budget_us;
+    bool print_gc_stats;
+    int gc_threads;
+    bool gc_compact;
+    bool huge_pages;
+    bool print_mem_stats;
+    // count executed opcode pairs and triples, the counts show which superinstructions pay off
+    bool profile_opcodes;
 } interpreter_params_t;
 
 typedef enum {
@@ -36,11 +58,52 @@ typedef struct {
     value_t stack[STACK_MAX];
     value_t* stack_top;
 
-    table_t globals;
+    // the compiler resolves global variables to slots, the table maps their names to them
+    table_t global_names;
+    value_array_t global_values;
     table_t strings;
     obj_upvalue_t* openUpvalues;
 
     obj_t* objects;
+
+    size_t bytes_allocated;
+    size_t next_gc;
+    double gc_grow_factor;
+    // threads taking part in marking, including the one that runs the collection
+    int gc_threads;
+    // compact the heap at the next safe point after a collection that freed a lot
+    bool gc_compact;
+    bool compact_pending;
+    heap_page_t* pages;
+
+    // quicken and fuse instructions, turned off to profile the instructions the compiler emits
+    bool specialize;
+
+    alloc_site_t alloc_site;
+    mem_stats_t mem_stats;
+
+    int gray_count;
+    int gray_capacity;
+    obj_t** gray_stack;
+
+#ifdef GC_GENERATIONAL
+    nursery_t nursery;
+#endif
+
+#ifdef GC_INCREMENTAL
+    gc_phase_t gc_phase;
+    uint64_t gc_step_budget_us;
+    size_t gc_next_step;
+    int gc_backedges;
+    int gc_weak_index;
+    int gc_weak_capacity;
+    obj_t* sweep_previous;
+    obj_t* sweep_current;
+#endif
+
+    gc_pause_stats_t gc_pauses;
+
+    source_buffer_t* sources;
 } vm_t;
 
 extern vm_t vm;
@@ -48,8 +111,15 @@ extern vm_t vm;
 void init_vm(void);
 void free_vm(void);
 
+// buffer for source code that is kept until free_vm, interpret() uses it without copying
+char* allocate_source(size_t size);
 interpret_result_t interpret(const char* source, interpreter_params_t* params);
 
+// slot of a global variable, a new one is added for names not seen before
+int global_slot(obj_string_t* name);
+// name of a global slot, slow, meant for error messages
+obj_string_t* global_name(int slot);
+
 void push(value_t value);
 value_t pop(void);
 
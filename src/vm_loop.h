@@ -0,0 +1,526 @@
+// the interpreter loop. vm.c includes this once per variant, with RUN_FUNCTION naming the
+// function, RUN_TRACE defined for the one that prints every instruction and RUN_PROFILE
+// for the one that counts opcode sequences.
+// the production loop has no per instruction check for tracing that way.
+
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+// gcc would otherwise merge the identical dispatch tails back into a single jump
+__attribute__((optimize("no-crossjumping")))
+#endif
+static interpret_result_t RUN_FUNCTION(void)
+{
+    // the hot state lives in locals, it is written back to the frame and the vm before
+    // anything that looks at it from outside: calls, allocations, collector work and errors
+    call_frame_t* frame;
+    uint8_t* ip;
+    value_t* slots;
+    value_t* constants;
+    value_t* stack_top = vm.stack_top;
+
+#define LOAD_FRAME() \
+    do { \
+        frame = &(vm.frames[vm.frame_count - 1]); \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+    } while (false)
+
+#define SAVE_STATE() \
+    do { \
+        frame->ip = ip; \
+        vm.stack_top = stack_top; \
+    } while (false)
+
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_LONG() (ip += 3, (int)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        SAVE_STATE(); \
+        runtime_error(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+// globals are declared when the compiler first sees their name, so a slot may still be empty
+#define GET_GLOBAL(slot) \
+    do { \
+        value_t value = vm.global_values.values[slot]; \
+        if (IS_UNDEFINED(value)) { \
+            obj_string_t* name = global_name(slot); \
+            RUNTIME_ERROR("Undefined variable '%.*s'.", name->length, name->chars); \
+        } \
+        PUSH(value); \
+    } while (false)
+
+#define SET_GLOBAL(slot) \
+    do { \
+        if (IS_UNDEFINED(vm.global_values.values[slot])) { \
+            obj_string_t* name = global_name(slot); \
+            RUNTIME_ERROR("Undefined variable '%.*s'.", name->length, name->chars); \
+        } \
+        vm.global_values.values[slot] = PEEK(0); \
+        write_barrier_value(PEEK(0)); \
+    } while (false)
+
+#define BINARY_OP(valueType, op) \
+    do { \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        PUSH(valueType(a op b)); \
+    } while (false)
+
+// quickened instructions check their operands and on a miss rewrite themselves back to the
+// generic instruction, which then runs in their place
+#define NUMBER_OP(valueType, op, generic) \
+    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) { \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        PUSH(valueType(a op b)); \
+    } else { \
+        *--ip = (generic); \
+    }
+
+// numbers seen once are usually seen every time, the instruction is specialized for them
+#define QUICKEN(op) \
+    do { \
+        if (vm.specialize) \
+            ip[-1] = (op); \
+    } while (false)
+
+    LOAD_FRAME();
+
+#ifdef RUN_TRACE
+#define TRACE_INSTRUCTION() do { SAVE_STATE(); trace_instruction(frame); } while (false)
+#elif defined(RUN_PROFILE)
+#define TRACE_INSTRUCTION() profile_instruction(*ip)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // every handler ends in its own indirect jump, which predicts far better than a shared one
+    static void* dispatch_table[] = {
+        [OP_CONSTANT] = &&do_OP_CONSTANT,
+        [OP_NIL] = &&do_OP_NIL,
+        [OP_TRUE] = &&do_OP_TRUE,
+        [OP_FALSE] = &&do_OP_FALSE,
+        [OP_POP] = &&do_OP_POP,
+        [OP_POPN] = &&do_OP_POPN,
+        [OP_GET_LOCAL] = &&do_OP_GET_LOCAL,
+        [OP_GET_GLOBAL] = &&do_OP_GET_GLOBAL,
+        [OP_GET_GLOBAL_LONG] = &&do_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL] = &&do_OP_DEFINE_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&do_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_LOCAL] = &&do_OP_SET_LOCAL,
+        [OP_SET_GLOBAL] = &&do_OP_SET_GLOBAL,
+        [OP_SET_GLOBAL_LONG] = &&do_OP_SET_GLOBAL_LONG,
+        [OP_GET_UPVALUE] = &&do_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&do_OP_SET_UPVALUE,
+        [OP_EQUAL] = &&do_OP_EQUAL,
+        [OP_GREATER] = &&do_OP_GREATER,
+        [OP_LESS] = &&do_OP_LESS,
+        [OP_CONSTANT_LONG] = &&do_OP_CONSTANT_LONG,
+        [OP_ADD] = &&do_OP_ADD,
+        [OP_SUBTRACT] = &&do_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&do_OP_MULTIPLY,
+        [OP_DIVIDE] = &&do_OP_DIVIDE,
+        [OP_NOT] = &&do_OP_NOT,
+        [OP_NEGATE] = &&do_OP_NEGATE,
+        [OP_PRINT] = &&do_OP_PRINT,
+        [OP_JUMP] = &&do_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&do_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_TRUE] = &&do_OP_JUMP_IF_TRUE,
+        [OP_LOOP] = &&do_OP_LOOP,
+        [OP_CALL] = &&do_OP_CALL,
+        [OP_CLOSURE] = &&do_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&do_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&do_OP_RETURN,
+        [OP_EQUAL_NUMBER] = &&do_OP_EQUAL_NUMBER,
+        [OP_GREATER_NUMBER] = &&do_OP_GREATER_NUMBER,
+        [OP_LESS_NUMBER] = &&do_OP_LESS_NUMBER,
+        [OP_ADD_NUMBER] = &&do_OP_ADD_NUMBER,
+        [OP_GET_LOCAL_CONSTANT] = &&do_OP_GET_LOCAL_CONSTANT,
+        [OP_JUMP_IF_FALSE_POP] = &&do_OP_JUMP_IF_FALSE_POP,
+        [OP_JUMP_IF_TRUE_POP] = &&do_OP_JUMP_IF_TRUE_POP,
+        [OP_POP_LOOP] = &&do_OP_POP_LOOP,
+        [OP_POP_JUMP] = &&do_OP_POP_JUMP,
+        [OP_GET_GLOBAL_GET_LOCAL] = &&do_OP_GET_GLOBAL_GET_LOCAL,
+        [OP_SET_LOCAL_POP] = &&do_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&do_OP_SET_GLOBAL_POP
+    };
+
+#define DISPATCH() do { TRACE_INSTRUCTION(); goto *dispatch_table[READ_BYTE()]; } while (false)
+#define CASE(op) do_##op
+#define NEXT DISPATCH()
+
+    DISPATCH();
+#else
+#define CASE(op) case op
+#define NEXT break
+
+    for (;;)
+    {
+        TRACE_INSTRUCTION();
+
+        switch (READ_BYTE())
+        {
+#endif
+
+        CASE(OP_CONSTANT): {
+            value_t constant = READ_CONSTANT();
+            PUSH(constant);
+            NEXT;
+        }
+
+        CASE(OP_CONSTANT_LONG): {
+            value_t constant = constants[READ_LONG()];
+            PUSH(constant);
+            NEXT;
+        }
+
+        CASE(OP_NIL): PUSH(NIL_VAL); NEXT;
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true)); NEXT;
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false)); NEXT;
+        CASE(OP_POP): stack_top--; NEXT;
+
+        CASE(OP_POPN): {
+            uint8_t n = READ_BYTE();
+            stack_top -= n;
+            NEXT;
+        }
+
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            NEXT;
+        }
+
+        CASE(OP_GET_GLOBAL): {
+            uint8_t slot = READ_BYTE();
+            GET_GLOBAL(slot);
+            NEXT;
+        }
+
+        CASE(OP_GET_GLOBAL_LONG): {
+            int slot = READ_LONG();
+            GET_GLOBAL(slot);
+            NEXT;
+        }
+
+        CASE(OP_DEFINE_GLOBAL): {
+            uint8_t slot = READ_BYTE();
+            vm.global_values.values[slot] = PEEK(0);
+            write_barrier_value(PEEK(0));
+            stack_top--;
+            NEXT;
+        }
+
+        CASE(OP_DEFINE_GLOBAL_LONG): {
+            int slot = READ_LONG();
+            vm.global_values.values[slot] = PEEK(0);
+            write_barrier_value(PEEK(0));
+            stack_top--;
+            NEXT;
+        }
+
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            NEXT;
+        }
+
+        CASE(OP_SET_GLOBAL): {
+            uint8_t slot = READ_BYTE();
+            SET_GLOBAL(slot);
+            NEXT;
+        }
+
+        CASE(OP_SET_GLOBAL_LONG): {
+            int slot = READ_LONG();
+            SET_GLOBAL(slot);
+            NEXT;
+        }
+
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            NEXT;
+        }
+
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            obj_upvalue_t* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            write_barrier((obj_t*)upvalue);
+            NEXT;
+        }
+
+        CASE(OP_EQUAL): {
+            if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1)))
+            {
+                // flattening allocates
+                SAVE_STATE();
+                flatten_slot(stack_top - 1);
+                flatten_slot(stack_top - 2);
+            }
+            else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+            {
+                QUICKEN(OP_EQUAL_NUMBER);
+            }
+            value_t a = POP();
+            value_t b = POP();
+            PUSH(BOOL_VAL(values_equal(a, b)));
+            NEXT;
+        }
+
+        CASE(OP_GREATER):    BINARY_OP(BOOL_VAL, >); QUICKEN(OP_GREATER_NUMBER); NEXT;
+        CASE(OP_LESS):       BINARY_OP(BOOL_VAL, <); QUICKEN(OP_LESS_NUMBER); NEXT;
+        CASE(OP_ADD): {
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+            {
+                QUICKEN(OP_ADD_NUMBER);
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            }
+            else if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1)))
+            {
+                SAVE_STATE();
+                concatenate();
+                stack_top = vm.stack_top;
+            }
+            else
+            {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            NEXT;
+        }
+        CASE(OP_SUBTRACT):   BINARY_OP(NUMBER_VAL, -); NEXT;
+        CASE(OP_MULTIPLY):   BINARY_OP(NUMBER_VAL, *); NEXT;
+        CASE(OP_DIVIDE):     BINARY_OP(NUMBER_VAL, /); NEXT;
+        CASE(OP_NOT): PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))); NEXT;
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0)))
+                RUNTIME_ERROR("Operand must be a number.");
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            NEXT;
+
+        CASE(OP_PRINT): {
+            SAVE_STATE();
+            flatten_slot(stack_top - 1);
+            print_value(POP());
+            printf("\n");
+            NEXT;
+        }
+
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            NEXT;
+        }
+
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0)))
+            {
+                ip += offset;
+            }
+            NEXT;
+        }
+
+        CASE(OP_JUMP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(PEEK(0)))
+            {
+                ip += offset;
+            }
+            NEXT;
+        }
+
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            // collector work scans the stack, minor collections and compaction only move objects, never the arrays cached here
+            SAVE_STATE();
+            gc_backedge();
+            gc_safepoint();
+            NEXT;
+        }
+
+        CASE(OP_CALL): {
+            uint8_t argCount = READ_BYTE();
+            SAVE_STATE();
+            if (!call_value(PEEK(argCount), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            gc_safepoint();
+            LOAD_FRAME();
+            stack_top = vm.stack_top;
+            NEXT;
+        }
+
+        CASE(OP_CLOSURE): {
+            obj_function_t* func = AS_FUNCTION(READ_CONSTANT());
+            SAVE_STATE();
+            obj_closure_t* clos = new_closure(func);
+            PUSH(OBJ_VAL(clos));
+            vm.stack_top = stack_top;
+            for (int i = 0; i < clos->upvalueCount; i++)
+            {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal)
+                    clos->upvalues[i] = capture_upvalue(slots + index);
+                else
+                    clos->upvalues[i] = frame->closure->upvalues[index];
+            }
+            NEXT;
+        }
+
+        CASE(OP_CLOSE_UPVALUE):
+            close_upvalues(stack_top - 1);
+            stack_top--;
+            NEXT;
+
+        CASE(OP_RETURN): {
+            value_t result = POP();
+
+            close_upvalues(slots);
+
+            vm.frame_count--;
+            if (vm.frame_count == 0)
+            {
+                vm.stack_top = stack_top;
+                return INTERPRET_OK;
+            }
+
+            stack_top = slots;
+            PUSH(result);
+
+            LOAD_FRAME();
+            NEXT;
+        }
+
+        CASE(OP_EQUAL_NUMBER): NUMBER_OP(BOOL_VAL, ==, OP_EQUAL); NEXT;
+        CASE(OP_GREATER_NUMBER): NUMBER_OP(BOOL_VAL, >, OP_GREATER); NEXT;
+        CASE(OP_LESS_NUMBER): NUMBER_OP(BOOL_VAL, <, OP_LESS); NEXT;
+        CASE(OP_ADD_NUMBER): NUMBER_OP(NUMBER_VAL, +, OP_ADD); NEXT;
+
+        // superinstructions step over the opcode of the second instruction, which is left in place
+        CASE(OP_GET_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            ip++;
+            value_t constant = READ_CONSTANT();
+            PUSH(slots[slot]);
+            PUSH(constant);
+            NEXT;
+        }
+
+        CASE(OP_JUMP_IF_FALSE_POP): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0)))
+            {
+                ip += offset;
+            }
+            else
+            {
+                stack_top--;
+                ip++;
+            }
+            NEXT;
+        }
+
+        CASE(OP_JUMP_IF_TRUE_POP): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(PEEK(0)))
+            {
+                ip += offset;
+            }
+            else
+            {
+                stack_top--;
+                ip++;
+            }
+            NEXT;
+        }
+
+        CASE(OP_POP_LOOP): {
+            stack_top--;
+            ip++;
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            SAVE_STATE();
+            gc_backedge();
+            gc_safepoint();
+            NEXT;
+        }
+
+        CASE(OP_POP_JUMP): {
+            stack_top--;
+            ip++;
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            NEXT;
+        }
+
+        CASE(OP_GET_GLOBAL_GET_LOCAL): {
+            uint8_t global = READ_BYTE();
+            GET_GLOBAL(global);
+            ip++;
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            NEXT;
+        }
+
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            ip++;
+            NEXT;
+        }
+
+        CASE(OP_SET_GLOBAL_POP): {
+            uint8_t slot = READ_BYTE();
+            SET_GLOBAL(slot);
+            stack_top--;
+            ip++;
+            NEXT;
+        }
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
+
+#undef LOAD_FRAME
+#undef SAVE_STATE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_LONG
+#undef RUNTIME_ERROR
+#undef GET_GLOBAL
+#undef SET_GLOBAL
+#undef BINARY_OP
+#undef NUMBER_OP
+#undef QUICKEN
+#undef TRACE_INSTRUCTION
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+}
+
+#undef RUN_FUNCTION
+#undef RUN_TRACE
+#undef RUN_PROFILE